@@ -13,6 +13,9 @@
 #ifndef LAMPLOADPROFILE_H
 #define LAMPLOADPROFILE_H
 
+#include <istream>
+#include "LAMP/LAMPProfileFormat.h"
+
 namespace llvm {
 
   class ModulePass;
@@ -42,16 +45,37 @@ namespace llvm {
     std::map<Instruction*, unsigned int> InstToIdMap;   // InstID -> Inst*
     std::map<unsigned int, BasicBlock*> IdToLoopMap;    // LoopID -> headerBB*
     std::map<BasicBlock*, unsigned int> LoopToIdMap;    // headerBB* -> LoopID
+    // The dependence maps are only built for text profiles; a binary
+    // profile is read in place through getLoopRecords
     std::map<std::pair<Instruction*, Instruction*>*, unsigned int> DepToTimesMap; 
     std::map<BasicBlock*, std::set<std::pair<Instruction*, Instruction*>* > > LoopToDepSetMap;
     std::map<BasicBlock*, unsigned int> LoopToMaxDepTimesMap;
+    double SampleScale;                                 // factor applied to sampled counts
 
     static unsigned int lamp_id;
     static char ID;
-    LAMPLoadProfile() : ModulePass (ID) {}
+    LAMPLoadProfile() : ModulePass (ID), SampleScale(1.0), Profile(NULL), ProfileSize(0) {}
+    ~LAMPLoadProfile();
 
     virtual bool runOnModule (Module &M);
     virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+
+    bool hasBinaryProfile() const { return Profile != NULL; }
+
+    // Raw records of LoopId from a binary profile, read in place without
+    // scaling and sorted by load; false if there are none or the profile
+    // was text
+    bool getLoopRecords(unsigned int LoopId, const lamp_profile_record_t *&Begin,
+                        const lamp_profile_record_t *&End) const;
+
+  private:
+    const lamp_profile_header_t *Profile;               // mapped binary profile, or NULL
+    uint64_t ProfileSize;
+
+    void printDependenceHeader();
+    void addDependence(unsigned int i1_id, unsigned int i2_id, unsigned int loop_id, unsigned int times);
+    void loadBinaryProfile();
+    void loadTextProfile(std::istream &ifs);
   };
 }
 #endif 
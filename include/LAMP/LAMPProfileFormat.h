@@ -0,0 +1,190 @@
+//===- LAMPProfileFormat.h - Binary LAMP profile layout --*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// On-disk layout of result.lamp.profile, shared by the LAMP runtime that
+// writes it and the LAMPLoadProfile pass that maps it back in. The file is
+// a header followed by an array of fixed-width dependence records, sorted
+// by (loop, load, dist, store), and a loop index giving the range of
+// records for each loop. All offsets are from the start of the file and
+// 8-byte aligned, so a mapped file can be used in place.
+//
+// The runtime writes the old text format instead when LAMP_PROFILE_TEXT is
+// set; lamp-dump prints a binary profile in that format and lamp-merge sums
+// several binary profiles into one.
+//
+//===----------------------------------------------------------------------===//
+#ifndef LAMPPROFILEFORMAT_H
+#define LAMPPROFILEFORMAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LAMP_PROFILE_MAGIC "LAMPPROF"
+#define LAMP_PROFILE_MAGIC_SIZE 8
+#define LAMP_PROFILE_VERSION 1
+
+typedef struct {
+  char magic[LAMP_PROFILE_MAGIC_SIZE];  // LAMP_PROFILE_MAGIC, not terminated
+  uint32_t version;                     // LAMP_PROFILE_VERSION
+  uint32_t record_size;                 // sizeof(lamp_profile_record_t)
+  uint64_t num_records;
+  uint64_t records_offset;
+  uint64_t num_loops;
+  uint64_t loops_offset;
+  uint32_t sample_period;               // 0 if every iteration was profiled
+  uint32_t sample_burst;                // iterations recorded per period,
+                                        // not counting the window's warm-up
+  uint32_t num_threads;
+  uint32_t max_depth;
+  uint64_t dyn_stores;
+  uint64_t dyn_loads;
+  uint64_t run_time_usec;
+} lamp_profile_header_t;
+
+// One profiled dependence: store -> load at distance dist in loop
+typedef struct {
+  uint32_t load;
+  uint32_t dist;
+  uint32_t loop;
+  uint32_t store;
+  uint64_t total_count;
+  uint64_t loop_count;
+} lamp_profile_record_t;
+
+// Records [first, first + count) all belong to loop
+typedef struct {
+  uint32_t loop;
+  uint32_t reserved;
+  uint64_t first;
+  uint64_t count;
+} lamp_profile_loop_t;
+
+// Returns the header if the size bytes at data hold a well-formed binary
+// profile, NULL otherwise (e.g. for a text profile).
+static inline const lamp_profile_header_t *
+lamp_profile_check(const void *data, uint64_t size) {
+  const lamp_profile_header_t *header = (const lamp_profile_header_t *) data;
+  if (size < sizeof(lamp_profile_header_t)
+      || memcmp(header->magic, LAMP_PROFILE_MAGIC, LAMP_PROFILE_MAGIC_SIZE) != 0
+      || header->version != LAMP_PROFILE_VERSION
+      || header->record_size != sizeof(lamp_profile_record_t))
+    return NULL;
+  if (header->records_offset % 8 != 0 || header->loops_offset % 8 != 0
+      || header->records_offset > size || header->loops_offset > size
+      || header->num_records > (size - header->records_offset) / sizeof(lamp_profile_record_t)
+      || header->num_loops > (size - header->loops_offset) / sizeof(lamp_profile_loop_t))
+    return NULL;
+  return header;
+}
+
+static inline const lamp_profile_record_t *
+lamp_profile_records(const lamp_profile_header_t *header) {
+  return (const lamp_profile_record_t *) ((const char *) header + header->records_offset);
+}
+
+static inline const lamp_profile_loop_t *
+lamp_profile_loops(const lamp_profile_header_t *header) {
+  return (const lamp_profile_loop_t *) ((const char *) header + header->loops_offset);
+}
+
+// Maps the profile at path read-only. Returns its header, or NULL if the
+// file cannot be read or is not a binary profile; *size receives the
+// mapping size to pass to lamp_profile_unmap.
+static inline const lamp_profile_header_t *
+lamp_profile_map(const char *path, uint64_t *size) {
+  struct stat sInfo;
+  void *data;
+  const lamp_profile_header_t *header;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &sInfo) != 0 || sInfo.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  data = mmap(NULL, sInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  header = lamp_profile_check(data, sInfo.st_size);
+  if (header == NULL) {
+    munmap(data, sInfo.st_size);
+    return NULL;
+  }
+  *size = sInfo.st_size;
+  return header;
+}
+
+static inline void
+lamp_profile_unmap(const lamp_profile_header_t *header, uint64_t size) {
+  munmap((void *) header, size);
+}
+
+// Record order within a file: by loop, then load, dist and store
+static inline int
+lamp_profile_record_compare(const lamp_profile_record_t *r1, const lamp_profile_record_t *r2) {
+  if (r1->loop != r2->loop)
+    return r1->loop < r2->loop ? -1 : 1;
+  if (r1->load != r2->load)
+    return r1->load < r2->load ? -1 : 1;
+  if (r1->dist != r2->dist)
+    return r1->dist < r2->dist ? -1 : 1;
+  if (r1->store != r2->store)
+    return r1->store < r2->store ? -1 : 1;
+  return 0;
+}
+
+// Writes a profile with the given records, which must already be in
+// lamp_profile_record_compare order. The caller fills in the sampling and
+// statistics fields of header; the rest are set here. Returns 0 on success.
+static inline int
+lamp_profile_write(FILE *file, lamp_profile_header_t *header,
+                   const lamp_profile_record_t *records, uint64_t num_records) {
+  uint64_t i, num_loops = 0;
+  for (i = 0; i < num_records; i++) {
+    if (i == 0 || records[i].loop != records[i - 1].loop)
+      num_loops++;
+  }
+
+  memcpy(header->magic, LAMP_PROFILE_MAGIC, LAMP_PROFILE_MAGIC_SIZE);
+  header->version = LAMP_PROFILE_VERSION;
+  header->record_size = sizeof(lamp_profile_record_t);
+  header->num_records = num_records;
+  header->records_offset = sizeof(lamp_profile_header_t);
+  header->num_loops = num_loops;
+  header->loops_offset = header->records_offset + num_records * sizeof(lamp_profile_record_t);
+
+  if (fwrite(header, sizeof(lamp_profile_header_t), 1, file) != 1
+      || fwrite(records, sizeof(lamp_profile_record_t), num_records, file) != num_records)
+    return -1;
+
+  lamp_profile_loop_t loop = { 0, 0, 0, 0 };
+  for (i = 0; i < num_records; i++) {
+    if (i == 0 || records[i].loop != records[i - 1].loop) {
+      if (i != 0 && fwrite(&loop, sizeof(loop), 1, file) != 1)
+        return -1;
+      loop.loop = records[i].loop;
+      loop.reserved = 0;
+      loop.first = i;
+      loop.count = 0;
+    }
+    loop.count++;
+  }
+  if (num_records != 0 && fwrite(&loop, sizeof(loop), 1, file) != 1)
+    return -1;
+  return fflush(file) == 0 ? 0 : -1;
+}
+
+#endif
@@ -9,6 +9,7 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/IR/DataLayout.h" //#include "llvm/Target/TargetData.h"
 #include "llvm/ADT/IndexedMap.h"
 #include <map>
@@ -16,11 +17,17 @@
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <algorithm>
 #include <sys/stat.h>
 #include "LAMP/LAMPLoadProfile.h"
 
 using namespace llvm;
 
+static cl::opt<std::string>
+LAMPProfileFile("lamp-profile-file", cl::init("result.lamp.profile"),
+                cl::value_desc("filename"),
+                cl::desc("LAMP profile to load, binary or text"));
+
 static std::map<unsigned int, BasicBlock*> IdToLoopMap_global;
 static std::map<BasicBlock*, unsigned int> LoopToIdMap_global;
 
@@ -137,56 +144,79 @@ char LAMPLoadProfile::ID = 0;
 unsigned int LAMPLoadProfile::lamp_id = -1;
 static RegisterPass<LAMPLoadProfile> Z("lamp-load-profile","Load back profile data and generate dependency information");
 
-bool LAMPLoadProfile::runOnModule(Module& M)
+void LAMPLoadProfile::printDependenceHeader()
 {
-	IdToLoopMap.insert(IdToLoopMap_global.begin(), IdToLoopMap_global.end());
-	LoopToIdMap.insert(LoopToIdMap_global.begin(), LoopToIdMap_global.end());
-  // build the <IDs, Instrucion> map
-	for (Module::iterator FB = M.begin(), FE = M.end(); FB != FE; FB++){
-  			// for all blocks in the function
-		if (!FB->isDeclaration())
-		for (Function::iterator BBB = FB->begin(), BBE = FB->end(); BBB != BBE; ++BBB)
-		{		// for all instructions in a block
-			for (BasicBlock::iterator IB = BBB->begin(), IE = BBB->end(); IB != IE; IB++)
-			{
-				if (isa<LoadInst>(IB) || isa<StoreInst>(IB)){ // count loads, stores, calls
-					IdToInstMap[++lamp_id]=IB;
-					InstToIdMap[IB]=lamp_id;
-				}
-				else if (isa<CallInst>(IB) && ( (dyn_cast<CallInst>(IB)->getCalledFunction() == NULL) || 
-							(dyn_cast<CallInst>(IB)->getCalledFunction()->isDeclaration()))){
-					IdToInstMap[++lamp_id]=IB;
-					InstToIdMap[IB]=lamp_id;
-				}
+	llvm::errs() << "--------------------------------------------------\n";
+	llvm::errs() << "  Inst_1 --> Inst_2        Loop          Count\n";
+	llvm::errs() << "--------------------------------------------------\n";
+}
+
+void LAMPLoadProfile::addDependence(unsigned int i1_id, unsigned int i2_id, unsigned int loop_id, unsigned int times)
+{
+	BasicBlock* BB;
+	std::map<BasicBlock*, std::set<std::pair<Instruction*, Instruction*>* > >::iterator iter;
+
+//	if (cross_iter){  // comment out for 583 hw2
+		if ( IdToInstMap[i1_id] != NULL && IdToInstMap[i2_id] !=NULL  ){
+			std::pair<Instruction*, Instruction*>* dep_inst_pair_ptr = new std::pair<Instruction*, Instruction*>;
+			dep_inst_pair_ptr->first  = IdToInstMap[i1_id];
+			dep_inst_pair_ptr->second = IdToInstMap[i2_id];
+			BB = IdToLoopMap_global[loop_id];
+
+			llvm::errs() << IdToInstMap[i1_id] << "(" << i1_id<< ")" << " " << IdToInstMap[i2_id] << "(" << i2_id<< ")" << ", "  << BB << "(" << loop_id << ") " ;
+			iter = LoopToDepSetMap.find(BB);
+			if (iter == LoopToDepSetMap.end() ){   // newly found loop
+				std::set <std::pair<Instruction*, Instruction*>* >* dep_pair_set_ptr = new std::set <std::pair<Instruction*, Instruction*>* >;
+				dep_pair_set_ptr->insert(dep_inst_pair_ptr);
+				LoopToDepSetMap[BB] = *dep_pair_set_ptr;
+				//llvm::errs() << " X " ;
+			}else{																 // loop already in the map
+				LoopToDepSetMap[BB].insert(dep_inst_pair_ptr);
+				//llvm::errs() << " O " ;
 			}
+			DepToTimesMap[dep_inst_pair_ptr] = times;	
+			llvm::errs() << times << "  " << /*LoopToDepSetMap.size() <<*/  "\n";
 		}
-	}
-	std::ifstream ifs;
-	struct stat sInfo;
+//	}  // comment out for 583 hw2
+}
 
-	if(stat("result.lamp.profile", &sInfo ) !=0){    // need to add file name
-		std::cerr << "Could not find file result.lamp.profile\n";
-		return false;
-	}
-	try{
-		ifs.open("result.lamp.profile");
-		//llvm::errs() << "Opened result.lamp.profile\n";
-	}catch (...){
-		std::cerr << "Could not find file result.lamp.profile\n";
-		return false;
+void LAMPLoadProfile::loadBinaryProfile()
+{
+	SampleScale = 1.0;
+	if (Profile->sample_period != 0 && Profile->sample_burst != 0){
+		SampleScale = (double) Profile->sample_period / Profile->sample_burst;
+		llvm::errs() << "Sampled profile, scaling counts by " << SampleScale << "\n";
 	}
+
+	// the records stay in the mapped file, see getLoopRecords
+	llvm::errs() << "Binary profile: " << Profile->num_records << " dependences in "
+	             << Profile->num_loops << " loops\n";
+}
+
+void LAMPLoadProfile::loadTextProfile(std::istream &ifs)
+{
 	std::string s;
-	// discard the first three strings ("BEGIN" "Memory" "Profile")
-	ifs >> s; ifs >> s; ifs >> s;
+	// a sampled profile starts with "SAMPLING <period> <burst>"; its counts
+	// cover the burst recorded iterations out of every period, so scale
+	// them back up. Dependences carried by outer loops are mostly missed
+	// by sampling and are not scaled back in.
+	SampleScale = 1.0;
+	ifs >> s;
+	if (s == "SAMPLING") {
+		unsigned int period = 1, burst = 1;
+		ifs >> period >> burst;
+		if (period != 0 && burst != 0)
+			SampleScale = (double) period / burst;
+		llvm::errs() << "Sampled profile, scaling counts by " << SampleScale << "\n";
+		ifs >> s;
+	}
+	// discard the rest of the header ("BEGIN" "Memory" "Profile")
+	ifs >> s; ifs >> s;
 
 	unsigned int num_cnt = 0;
 	unsigned int num, i1_id=0, i2_id=0, cross_iter=0, loop_id=0, times=0;
-	BasicBlock* BB;
-	std::map<BasicBlock*, std::set<std::pair<Instruction*, Instruction*>* > >::iterator iter;
 
-	llvm::errs() << "--------------------------------------------------\n";
-	llvm::errs() << "  Inst_1 --> Inst_2        Loop          Count\n";
-	llvm::errs() << "--------------------------------------------------\n";
+	printDependenceHeader();
 
   while (ifs >> s)
 	{
@@ -225,29 +255,8 @@ bool LAMPLoadProfile::runOnModule(Module& M)
 				i2_id = num;
 				break;
 			case 5:
-				times = num;
-//				if (cross_iter){  // comment out for 583 hw2
-					if ( IdToInstMap[i1_id] != NULL && IdToInstMap[i2_id] !=NULL  ){
-						std::pair<Instruction*, Instruction*>* dep_inst_pair_ptr = new std::pair<Instruction*, Instruction*>;
-						dep_inst_pair_ptr->first  = IdToInstMap[i1_id];
-						dep_inst_pair_ptr->second = IdToInstMap[i2_id];
-						BB = IdToLoopMap_global[loop_id];
-
-						llvm::errs() << IdToInstMap[i1_id] << "(" << i1_id<< ")" << " " << IdToInstMap[i2_id] << "(" << i2_id<< ")" << ", "  << BB << "(" << loop_id << ") " ;
-						iter = LoopToDepSetMap.find(BB);
-						if (iter == LoopToDepSetMap.end() ){   // newly found loop
-							std::set <std::pair<Instruction*, Instruction*>* >* dep_pair_set_ptr = new std::set <std::pair<Instruction*, Instruction*>* >;
-							dep_pair_set_ptr->insert(dep_inst_pair_ptr);
-							LoopToDepSetMap[BB] = *dep_pair_set_ptr;
-							//llvm::errs() << " X " ;
-						}else{																 // loop already in the map
-							LoopToDepSetMap[BB].insert(dep_inst_pair_ptr);
-							//llvm::errs() << " O " ;
-						}
-						DepToTimesMap[dep_inst_pair_ptr] = times;	
-						llvm::errs() << times << "  " << /*LoopToDepSetMap.size() <<*/  "\n";
-					}
-//				}  // comment out for 583 hw2
+				times = (unsigned int) (num * SampleScale + 0.5);
+				addDependence(i1_id, i2_id, loop_id, times);
 				break;  
 			case 0:
 				break;
@@ -255,7 +264,74 @@ bool LAMPLoadProfile::runOnModule(Module& M)
 				break;
 		}
 	} // end of while(ifs >> s)
+}
+
+static bool loopIndexLess(const lamp_profile_loop_t &Entry, unsigned int LoopId)
+{
+	return Entry.loop < LoopId;
+}
+
+bool LAMPLoadProfile::getLoopRecords(unsigned int LoopId, const lamp_profile_record_t *&Begin,
+                                     const lamp_profile_record_t *&End) const
+{
+	if (Profile == NULL)
+		return false;
+	const lamp_profile_loop_t *LB = lamp_profile_loops(Profile);
+	const lamp_profile_loop_t *LE = LB + Profile->num_loops;
+	const lamp_profile_loop_t *L = std::lower_bound(LB, LE, LoopId, loopIndexLess);
+	if (L == LE || L->loop != LoopId || L->first > Profile->num_records
+	    || L->count > Profile->num_records - L->first)
+		return false;
+	Begin = lamp_profile_records(Profile) + L->first;
+	End = Begin + L->count;
+	return true;
+}
+
+LAMPLoadProfile::~LAMPLoadProfile()
+{
+	if (Profile != NULL)
+		lamp_profile_unmap(Profile, ProfileSize);
+}
+
+bool LAMPLoadProfile::runOnModule(Module& M)
+{
+	IdToLoopMap.insert(IdToLoopMap_global.begin(), IdToLoopMap_global.end());
+	LoopToIdMap.insert(LoopToIdMap_global.begin(), LoopToIdMap_global.end());
+  // build the <IDs, Instrucion> map
+	for (Module::iterator FB = M.begin(), FE = M.end(); FB != FE; FB++){
+  			// for all blocks in the function
+		if (!FB->isDeclaration())
+		for (Function::iterator BBB = FB->begin(), BBE = FB->end(); BBB != BBE; ++BBB)
+		{		// for all instructions in a block
+			for (BasicBlock::iterator IB = BBB->begin(), IE = BBB->end(); IB != IE; IB++)
+			{
+				if (isa<LoadInst>(IB) || isa<StoreInst>(IB)){ // count loads, stores, calls
+					IdToInstMap[++lamp_id]=IB;
+					InstToIdMap[IB]=lamp_id;
+				}
+				else if (isa<CallInst>(IB) && ( (dyn_cast<CallInst>(IB)->getCalledFunction() == NULL) || 
+							(dyn_cast<CallInst>(IB)->getCalledFunction()->isDeclaration()))){
+					IdToInstMap[++lamp_id]=IB;
+					InstToIdMap[IB]=lamp_id;
+				}
+			}
+		}
+	}
+	struct stat sInfo;
+	if(stat(LAMPProfileFile.c_str(), &sInfo ) !=0){
+		std::cerr << "Could not find file " << LAMPProfileFile << "\n";
+		return false;
+	}
+
+	// A binary profile is used in place; anything else is parsed as text
+	Profile = lamp_profile_map(LAMPProfileFile.c_str(), &ProfileSize);
+	if (Profile != NULL){
+		loadBinaryProfile();
+		return true;
+	}
 
+	std::ifstream ifs(LAMPProfileFile.c_str());
+	loadTextProfile(ifs);
 
 	llvm::errs() << "--------------------------------------------------\n";
 	llvm::errs() << "  Max Dep Count in each Loop\n";
@@ -263,7 +339,7 @@ bool LAMPLoadProfile::runOnModule(Module& M)
 
 	std::map<BasicBlock*, std::set<std::pair<Instruction*, Instruction*>* > > :: iterator  Liter;
 	std::set<std::pair<Instruction*, Instruction*>* > :: iterator  Siter;
-	unsigned int max_times;
+	unsigned int max_times, times;
 	unsigned int  Id1=0, Id2=0;
   //for (int i = lamp_id+1; i< ;i ++ )
 	llvm::errs() << "Num of cross-dep Loops: "<< LoopToDepSetMap.size() << "\n";
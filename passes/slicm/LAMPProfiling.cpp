@@ -1,4 +1,4 @@
-
+#define DEBUG_TYPE "lamp-profiling"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Module.h"
@@ -9,9 +9,17 @@
 #include "llvm/Support/Compiler.h"
 
 #include "llvm/Analysis/LoopPass.h"	//TRM 7/21/08
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/Passes.h"	//TRM 7/21/08
+#include "llvm/Support/CallSite.h"
+#include "llvm/Support/CFG.h"
 
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 
 #include "LAMP/LAMPProfiling.h"
@@ -22,6 +30,20 @@
 using namespace llvm;
 using namespace std;
 
+STATISTIC(NumInstrumented, "Number of loads and stores instrumented for LAMP");
+STATISTIC(NumSkipped, "Number of loads and stores left out by selective LAMP profiling");
+
+static cl::opt<bool>
+SelectiveProfiling("lamp-selective", cl::init(false),
+                   cl::desc("Only instrument loads in loops that may alias a "
+                            "store or call in the same loop, those stores, "
+                            "and the stores of functions called in loops"));
+
+static cl::opt<bool>
+FastPathHooks("lamp-fast-path", cl::init(false),
+              cl::desc("Call the inlinable LAMP_fast_* access hooks; link "
+                       "lamp_fast_path.bc into the program and inline them"));
+
 // This class is a module pass designed to do no modification or instrumentation but count the number of
 // loads, stores, and calls for the initialization call.  It also tracks the loop counts generated by the
 // loop profiler so they can be accessed by the initializing pass.
@@ -103,11 +125,23 @@ namespace {
 	Constant* DeallocFn;
 	void createLampDeclarations(Module* M);
 	int getIndex(Type* ty);
+	void findRelevantAccesses(SmallPtrSet<Instruction*, 32> &Relevant);
+	void findLoopCallees(Module &M);
+	void addCallees(CallSite CS, SmallVectorImpl<Function*> &Worklist);
+	// functions that may run within a loop iteration and write memory
+	SmallPtrSet<Function*, 16> LoopCallees;
+	bool LoopCalleesFound;
 	DataLayout* TD;  //TargetData* TD;
+	LoopInfo* LI;
+	AliasAnalysis* AA;
   public:
 	virtual void getAnalysisUsage(AnalysisUsage &AU) const {
 			AU.addRequired<DataLayout>();
       //AU.addRequired<TargetData>();
+			if (SelectiveProfiling) {
+				AU.addRequired<LoopInfo>();
+				AU.addRequired<AliasAnalysis>();
+			}
   }
 
 	bool doInitialization(Module &M) { return false; }
@@ -116,7 +150,7 @@ namespace {
 	LAMPProfiler() : FunctionPass(ID) 
 	{ //instruction_id = 0; 
 	  lampFuncs[0] = NULL;
-	  TD = NULL; } 
+	  TD = NULL; LI = NULL; AA = NULL; LoopCalleesFound = false; } 
   };
 }
 
@@ -133,6 +167,9 @@ void LAMPProfiler::createLampDeclarations(Module* M)
 {
 	std::string f[] = {"LAMP_load1", "LAMP_load2", "LAMP_load4", "LAMP_load8", 
 		 		  "LAMP_store1", "LAMP_store2",	"LAMP_store4", "LAMP_store8"};
+	if (FastPathHooks)
+		for (int i=0; i < 8; i++)
+			f[i].replace(0, 5, "LAMP_fast_");
 
 	std::string FnName = "LAMP_register";
 	std::string AllocName = "LAMP_allocate";
@@ -172,6 +209,101 @@ int LAMPProfiler::getIndex(Type* ty)
 	}
 }
 
+// Only a load in a loop with a store to the same memory can have a
+// loop-carried dependence that SLICM would speculate on. Every load and
+// store of a loop nest shares its outermost loop, so checking each
+// outermost loop finds all such pairs. A call in the loop that may write
+// the load's memory counts as such a store; the stores it makes are
+// instrumented through LoopCallees, and external ones by the runtime.
+void LAMPProfiler::findRelevantAccesses(SmallPtrSet<Instruction*, 32> &Relevant)
+{
+	for (LoopInfo::iterator L = LI->begin(), LE = LI->end(); L != LE; ++L)
+	{
+		SmallVector<LoadInst*, 16> Loads;
+		SmallVector<StoreInst*, 16> Stores;
+		SmallVector<Instruction*, 16> Calls;
+		for (Loop::block_iterator BB = (*L)->block_begin(), BE = (*L)->block_end(); BB != BE; ++BB)
+			for (BasicBlock::iterator I = (*BB)->begin(), E = (*BB)->end(); I != E; ++I)
+			{
+				if (LoadInst *Ld = dyn_cast<LoadInst>(I))
+					Loads.push_back(Ld);
+				else if (StoreInst *St = dyn_cast<StoreInst>(I))
+					Stores.push_back(St);
+				else if (isa<CallInst>(I) || isa<InvokeInst>(I))
+					Calls.push_back(I);
+			}
+
+		for (unsigned i = 0; i != Loads.size(); ++i)
+		{
+			AliasAnalysis::Location LoadLoc = AA->getLocation(Loads[i]);
+			for (unsigned j = 0; j != Stores.size(); ++j)
+				if (AA->alias(LoadLoc, AA->getLocation(Stores[j])) != AliasAnalysis::NoAlias)
+				{
+					Relevant.insert(Loads[i]);
+					Relevant.insert(Stores[j]);
+				}
+			for (unsigned j = 0; j != Calls.size(); ++j)
+				if (AA->getModRefInfo(Calls[j], LoadLoc) & AliasAnalysis::Mod)
+					Relevant.insert(Loads[i]);
+		}
+	}
+}
+
+// Add the defined functions CS may call to Worklist, unless CS cannot write
+// memory. An indirect call may reach any function whose address is taken.
+void LAMPProfiler::addCallees(CallSite CS, SmallVectorImpl<Function*> &Worklist)
+{
+	if (AA->onlyReadsMemory(CS))
+		return;
+
+	if (Function *Callee = CS.getCalledFunction())
+	{
+		if (!Callee->isDeclaration() && LoopCallees.insert(Callee))
+			Worklist.push_back(Callee);
+		return;
+	}
+
+	Module *M = CS.getInstruction()->getParent()->getParent()->getParent();
+	for (Module::iterator F = M->begin(), FE = M->end(); F != FE; ++F)
+		if (!F->isDeclaration() && F->hasAddressTaken() && LoopCallees.insert(F))
+			Worklist.push_back(F);
+}
+
+// A store in a function called from a loop, directly or not, can conflict
+// with the loop's loads like one of its own, so every store of such a
+// function is instrumented. Other functions' loops are not available to a
+// function pass, so a call is taken to be in a loop when its block is on a
+// CFG cycle. This runs once, before any function has been instrumented.
+void LAMPProfiler::findLoopCallees(Module &M)
+{
+	SmallVector<Function*, 16> Worklist;
+	for (Module::iterator F = M.begin(), FE = M.end(); F != FE; ++F)
+	{
+		if (F->isDeclaration())
+			continue;
+		for (scc_iterator<Function*> SCC = scc_begin(&*F), SE = scc_end(&*F); SCC != SE; ++SCC)
+		{
+			if (!SCC.hasLoop())
+				continue;
+			for (std::vector<BasicBlock*>::iterator BB = (*SCC).begin(), BE = (*SCC).end(); BB != BE; ++BB)
+				for (BasicBlock::iterator I = (*BB)->begin(), E = (*BB)->end(); I != E; ++I)
+					if (CallSite CS = CallSite(I))
+						addCallees(CS, Worklist);
+		}
+	}
+
+	// everything a loop callee calls runs within the same iteration
+	while (!Worklist.empty())
+	{
+		Function *F = Worklist.pop_back_val();
+		for (Function::iterator BB = F->begin(), BE = F->end(); BB != BE; ++BB)
+			for (BasicBlock::iterator I = BB->begin(), E = BB->end(); I != E; ++I)
+				if (CallSite CS = CallSite(I))
+					addCallees(CS, Worklist);
+	}
+	LoopCalleesFound = true;
+}
+
 bool LAMPProfiler::runOnFunction(Function &F) {
 
 	if (lampFuncs[0] == NULL)
@@ -185,6 +317,18 @@ bool LAMPProfiler::runOnFunction(Function &F) {
 	if (TD == NULL)
 		TD = &getAnalysis<DataLayout>();
 		//TD = &getAnalysis<TargetData>();
+
+	// Skipped accesses still take an id, so ids match LAMPLoadProfile's
+	SmallPtrSet<Instruction*, 32> Relevant;
+	if (SelectiveProfiling)
+	{
+		LI = &getAnalysis<LoopInfo>();
+		AA = &getAnalysis<AliasAnalysis>();
+		if (!LoopCalleesFound)
+			findLoopCallees(*F.getParent());
+		findRelevantAccesses(Relevant);
+	}
+
 	for (Function::iterator IF = F.begin(), IE = F.end(); IF != IE; ++IF)
 	{
 		
@@ -196,18 +340,25 @@ bool LAMPProfiler::runOnFunction(Function &F) {
 				// Instrument Loads
 			if (isa<LoadInst>(I))
 			{
+				++instruction_id;
+				if (SelectiveProfiling && !Relevant.count(I))
+				{
+					++NumSkipped;
+					continue;
+				}
+				++NumInstrumented;
+
 				std::vector<Value*> Args(2);
 		
-				Args[0] = ConstantInt::get(llvm::Type::getInt32Ty(F.getContext()), ++instruction_id);
+				Args[0] = ConstantInt::get(llvm::Type::getInt32Ty(F.getContext()), instruction_id);
 
 				Value* ptr= (dyn_cast<LoadInst>(I))->getPointerOperand();
 				Args[1] = new PtrToIntInst(ptr, llvm::Type::getInt64Ty(F.getContext()), "addr_var", I);
-				
-			  Value* v = new LoadInst(ptr, "value_var", I);
 
 //				int index = getIndex(Args[1]->getType());  
 
-				int index = getIndex(v->getType());        
+				// size the access by the pointee type instead of loading the value
+				int index = getIndex(cast<PointerType>(ptr->getType())->getElementType());
 				// cerr << index << " " << *I  ; // DEBUG
 				// Changed function
 				CallInst::Create(lampFuncs[index], Args, "", I);
@@ -215,9 +366,17 @@ bool LAMPProfiler::runOnFunction(Function &F) {
 				// Instrument Stores
 	    		else if (isa<StoreInst>(I))
 			{
+				++instruction_id;
+				if (SelectiveProfiling && !Relevant.count(I) && !LoopCallees.count(&F))
+				{
+					++NumSkipped;
+					continue;
+				}
+				++NumInstrumented;
+
 				std::vector<Value*> Args(3);
 	
-				Args[0] = ConstantInt::get(llvm::Type::getInt32Ty(F.getContext()), ++instruction_id);
+				Args[0] = ConstantInt::get(llvm::Type::getInt32Ty(F.getContext()), instruction_id);
 	
 				Value* ptr= (dyn_cast<StoreInst>(I))->getPointerOperand();
 				Args[1] = new PtrToIntInst(ptr, llvm::Type::getInt64Ty(F.getContext()), "addr_var", I);
@@ -1,134 +1,589 @@
 #include "redobbbuilder.h"
 #include "slicm.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 
 using namespace ucw;
 
-/// Create check flag for `LD`, which is set to true if
-/// the memory at `LD.getOperand(0)` is changed
+static cl::opt<RedoBBBuilder::CheckKind>
+CheckMode("slicm-check-mode", cl::init(RedoBBBuilder::ValueCheck),
+          cl::desc("How aliasing stores are checked against speculatively "
+                   "hoisted loads"),
+          cl::values(clEnumValN(RedoBBBuilder::ValueCheck, "value",
+                                "Reload the value around the store and compare"),
+                     clEnumValN(RedoBBBuilder::RangeCheck, "range",
+                                "Compare address ranges, without extra loads"),
+                     clEnumValEnd));
+
+static cl::opt<bool>
+Versioning("slicm-versioning", cl::init(false),
+           cl::desc("Decide check flags once before the loop when all "
+                    "aliasing stores have affine addresses"));
+
+namespace {
+/// Rewrites the loads and stores of a check flag into SSA form.
+class FlagPromoter : public LoadAndStorePromoter
+{
+    DenseSet<Instruction *> &CheckingInstrs;
+public:
+    FlagPromoter(const SmallVectorImpl<Instruction *> &Insts, SSAUpdater &S,
+                 StringRef Name, DenseSet<Instruction *> &CI)
+        : LoadAndStorePromoter(Insts, S, Name), CheckingInstrs(CI) { }
+
+    virtual void instructionDeleted(Instruction *I) const
+    {
+        CheckingInstrs.erase(I);
+    }
+};
+} // end anon namespace
+
+/// Create check flag for `I`, which is set to true if
+/// the memory `I` reads is changed
 /// returns the created flag address value
-Value *RedoBBBuilder::createCheckFlag(LoadInst &LD)
+/// The flag lives in an alloca only while the checks are being built,
+/// PromoteFlags turns it into SSA values afterwards
+Value *RedoBBBuilder::createCheckFlag(Instruction &I)
 {
-    // reuse flag for the same memory address
-    Value *flag = LdToFlagMap[&LD];
-    if (flag) {
-        DEBUG(dbgs() << "    Reuse existing flag.\n");
-    } else {
-        // create flag variable
-        BasicBlock *prepre = pass->getOrCreatePrePreheader();
-        BasicBlock *postPre = pass->getOrCreatePostPreheader();
-        flag = new AllocaInst(Type::getInt1Ty(LD.getContext()),
-                              LD.getName() + ".flag",
-                              prepre->getTerminator());
+    BasicBlock *postPre = pass->getOrCreatePostPreheader();
+    Value *flag = createEntryAlloca(Type::getInt1Ty(I.getContext()), I.getName() + ".flag");
+    Flags.push_back(flag);
+
+    DEBUG(dbgs() << "        Created check flag '" << flag->getName() << "' for (" << I << "  )\n");
+
+    // with versioning, the flag is decided once before the loop and
+    // never changes, so no store needs to be checked
+    LoadInst *LD = dyn_cast<LoadInst>(&I);
+    Value *init = Versioning && LD ? createVersionCheck(*LD) : 0;
+    if (init) {
+        new StoreInst(init, flag, postPre->getTerminator());
+        VersionedFlags[flag] = init;
+        return flag;
+    }
 
-        new StoreInst(ConstantInt::getFalse(LD.getContext()),
-                    flag, postPre->getTerminator());
+    new StoreInst(ConstantInt::getFalse(I.getContext()), flag, postPre->getTerminator());
 
-        LdToFlagMap[&LD] = flag;
+    if (CallInst *CI = dyn_cast<CallInst>(&I)) {
+        insertCallCheck(*CI, flag);
+        return flag;
     }
 
-    DEBUG(dbgs() << "        Created check flag '" << flag->getName() << "' for (" << LD << "  )\n");
+    // range checks against all loads of the alias set are built at once
+    if (CheckMode == RangeCheck && !isSpeculativeValue(LD->getOperand(0))) {
+        AliasSetToLoads[&pass->getAliasSetForLoadSrc(LD)].push_back(LD);
+        return flag;
+    }
 
     // insert check to potential stores
     // insert check to all potential alias address users
-    for (auto pointerRec : pass->getAliasSetForLoadSrc(&LD)) {
-        insertCheck(pointerRec.getValue(), LD.getOperand(0), flag);
+    for (auto pointerRec : pass->getAliasSetForLoadSrc(LD)) {
+        insertCheck(pointerRec.getValue(), LD->getOperand(0), flag);
     }
 
     return flag;
 }
 
-/// check if value in memory at `memAddr` was changed when accessing `val`, store result into flag
-void RedoBBBuilder::insertCheck(Value *val, Value *memAddr, Value* flag)
+/// Build the range checks of the loads deferred by createCheckFlag: each
+/// store of an alias set is compared once against the range spanning all
+/// of the set's loads, and the result is merged into each load's own flag
+void RedoBBBuilder::FinalizeChecks()
 {
-    for (auto it = val->use_begin(), ite = val->use_end(); it != ite; it++) {
-        if (StoreInst *SI = dyn_cast<StoreInst>(*it)) {
-            // skip those not in current top loop
-            if (!isCurrentTopLoop(*SI)) { continue; }
+    for (auto &pair : AliasSetToLoads) {
+        SmallVectorImpl<LoadInst *> &loads = pair.second;
+        Type *intPtrTy = getIntPtrType(loads[0]->getContext());
+        Instruction *insertPt = pass->Preheader->getTerminator();
+
+        // %hull.begin  = umin of the loads' begins
+        // %hull.end    = umax of the loads' ends
+        std::pair<Value *, Value *> hull;
+        for (auto LD : loads) {
+            uint64_t size = pass->AA->getTypeStoreSize(LD->getType());
+            std::pair<Value *, Value *> range =
+                getInvariantAddrRange(LD->getOperand(0), size, intPtrTy);
+            if (!hull.first) {
+                hull = range;
+                continue;
+            }
+            ICmpInst *lt = new ICmpInst(insertPt, ICmpInst::ICMP_ULT,
+                                        range.first, hull.first);
+            hull.first = SelectInst::Create(lt, range.first, hull.first,
+                                            "hull.begin", insertPt);
+            ICmpInst *gt = new ICmpInst(insertPt, ICmpInst::ICMP_UGT,
+                                        range.second, hull.second);
+            hull.second = SelectInst::Create(gt, range.second, hull.second,
+                                             "hull.end", insertPt);
+        }
 
-            // skip instruction we don't interested in
-            if (!shouldCheck(*SI)) { continue; }
+        SmallVector<StoreInst *, 8> stores;
+        for (auto pointerRec : *pair.first) {
+            collectStores(pointerRec.getValue(), stores);
+        }
+        for (auto SI : stores) {
+            uint64_t stSize = pass->AA->getTypeStoreSize(SI->getValueOperand()->getType());
+            std::pair<Value *, Value *> stRange =
+                createAddrRange(SI->getPointerOperand(), stSize, intPtrTy, SI);
+            Instruction *chkRes = createOverlap(stRange, hull, SI);
+
+            DEBUG(dbgs() << "        Inserted check '" << chkRes->getName()
+                        << "' of " << loads.size() << " loads for (" << *SI
+                        << "  ) in " << SI->getParent()->getName() << "\n");
+
+            for (auto LD : loads) {
+                insertFlagUpdate(chkRes, SpecToRedo[LD].Flag);
+            }
+        }
+    }
+    AliasSetToLoads.clear();
+}
 
-            // if we have checked this store for this memAddr
-            CmpInst *chkRes = 0;
-            if (StoreToCheckMap.count(SI)) {
-                for (auto pair : StoreToCheckMap[SI]) {
-                    if (pair.first == memAddr) {
-                        chkRes = pair.second;
-                        DEBUG(dbgs() << "        Found existing check '" << chkRes->getName()
-                                    << "' for (" << *SI << "  ) in "
-                                    << SI->getParent()->getName() << "\n");
-                    }
+/// Set `flag` after every store that may write memory read by `CI`.
+/// The call's arguments are not compared against the store, so any such
+/// store redoes the call
+void RedoBBBuilder::insertCallCheck(CallInst &CI, Value *flag)
+{
+    SmallVector<StoreInst *, 8> stores;
+    collectCallClobbers(CI, stores);
+
+    for (auto SI : stores) {
+        // store true, %flag
+        // the next instr after STORE we checking
+        StoreInst *set = new StoreInst(ConstantInt::getTrue(CI.getContext()),
+                                       flag, SI->getNextNode());
+        CheckingInstrs.insert(set);
+
+        DEBUG(dbgs() << "        Set " << flag->getName() << " after (" << *SI
+                    << "  ) in " << SI->getParent()->getName() << "\n");
+    }
+}
+
+/// Collect the stores in the loop that may write memory read by `CI`
+void RedoBBBuilder::collectCallClobbers(CallInst &CI, SmallVectorImpl<StoreInst *> &stores) const
+{
+    AliasAnalysis *AA = pass->AA;
+    for (AliasSetTracker::iterator it = pass->CurAST->begin(), ite = pass->CurAST->end();
+         it != ite; ++it) {
+        AliasSet &AS = *it;
+        if (AS.isForwardingAliasSet() || !AS.isMod()) { continue; }
+
+        for (auto pointerRec : AS) {
+            SmallVector<StoreInst *, 8> candidates;
+            collectStores(pointerRec.getValue(), candidates);
+            for (auto SI : candidates) {
+                if (AA->getModRefInfo(&CI, AA->getLocation(SI)) & AliasAnalysis::Ref) {
+                    stores.push_back(SI);
                 }
             }
+        }
+    }
+}
+
+/// check if value in memory at `memAddr` was changed when accessing `val`, store result into flag
+void RedoBBBuilder::insertCheck(Value *val, Value *memAddr, Value* flag)
+{
+    SmallVector<StoreInst *, 8> stores;
+    collectStores(val, stores);
+
+    for (auto SI : stores) {
+        // if we have checked this store for this memAddr
+        Instruction *chkRes = findCheck(SI, memAddr);
+        if (chkRes) {
+            DEBUG(dbgs() << "        Found existing check '" << chkRes->getName()
+                        << "' for (" << *SI << "  ) in "
+                        << SI->getParent()->getName() << "\n");
+        } else {
+            if (CheckMode == RangeCheck) {
+                chkRes = createRangeCheck(SI, memAddr);
+            }
+            // fall back to comparing values if the access sizes are unknown
             if (!chkRes) {
-                // check if before and after the store, the memore address changed
-                //
-                // %orig        = load %memAddr
-                // the STORE we checking
-                // %modified    = load %memAddr
-                // %cmp         = icmp ne, %orig, %modified
-                LoadInst *orig = new LoadInst(memAddr, "", SI);
-
-                Instruction *next = SI->getNextNode();
-                LoadInst *modified = new LoadInst(memAddr, "", next);
-                chkRes = CmpInst::Create(Instruction::ICmp,
-                                         CmpInst::ICMP_NE,
-                                         orig, modified,
-                                         "chk", next);
-
-                CheckingInstrs.insert(orig);
-                CheckingInstrs.insert(modified);
-                CheckingInstrs.insert(chkRes);
-
-                // set consitant name
-                orig->setName(chkRes->getName() + ".orig");
-                modified->setName(chkRes->getName() + ".mod");
-
-                StoreToCheckMap[SI].push_back({memAddr, chkRes});
-
-                DEBUG(dbgs() << "        Inserted check '" << chkRes->getName()
-                            << "' for (" << *SI << "  ) in "
-                            << SI->getParent()->getName() << "\n");
+                chkRes = createValueCheck(SI, memAddr);
             }
 
+            StoreToCheckMap[SI].push_back({memAddr, chkRes});
 
-            // if we have stored the check result to the flag
-            Check pair = {memAddr, chkRes};
-            for (auto f : CheckToFlagMap[pair]) {
-                if (f == flag) {
-                    DEBUG(dbgs() << "        Existing flag store found\n");
-                    return;
-                }
+            DEBUG(dbgs() << "        Inserted check '" << chkRes->getName()
+                        << "' for (" << *SI << "  ) in "
+                        << SI->getParent()->getName() << "\n");
+        }
+
+        // if we have stored the check result to the flag
+        Check pair = {memAddr, chkRes};
+        auto &flags = CheckToFlagMap[pair];
+        if (std::find(flags.begin(), flags.end(), flag) != flags.end()) {
+            DEBUG(dbgs() << "        Existing flag store found\n");
+            continue;
+        }
+
+        insertFlagUpdate(chkRes, flag);
+        flags.push_back(flag);
+    }
+}
+
+/// Merge the check result `chkRes` into `flag`, right after the check
+void RedoBBBuilder::insertFlagUpdate(Instruction *chkRes, Value *flag)
+{
+    DEBUG(dbgs() << "            Check result stored to " << flag->getName() << "\n");
+    // merge old value and new value with or
+    //
+    // %oldflgval   = load %flag
+    // %newflgval   = or %oldflgval, %chkRes
+    // store  %newflgval, %flag
+    // the next instr after STORE we checking
+    Instruction *next = chkRes->getNextNode();
+    LoadInst *oldflgval = new LoadInst(flag, flag->getName() + ".oldval", next);
+    auto *newflgval = BinaryOperator::Create(Instruction::Or,
+                                             oldflgval, chkRes,
+                                             flag->getName() + ".newval",
+                                             next);
+    StoreInst *st = new StoreInst(newflgval, flag, next);
+    CheckingInstrs.insert(oldflgval);
+    CheckingInstrs.insert(newflgval);
+    CheckingInstrs.insert(st);
+}
+
+/// Check whether `SI` changed the value in memory at `memAddr` by loading it
+/// before and after the store. Silent stores are not reported
+Instruction *RedoBBBuilder::createValueCheck(StoreInst *SI, Value *memAddr)
+{
+    // %orig        = load %memAddr
+    // the STORE we checking
+    // %modified    = load %memAddr
+    // %cmp         = icmp ne, %orig, %modified
+    LoadInst *orig = new LoadInst(memAddr, "", SI);
+
+    Instruction *next = SI->getNextNode();
+    LoadInst *modified = new LoadInst(memAddr, "", next);
+    CmpInst *chkRes = CmpInst::Create(Instruction::ICmp,
+                                      CmpInst::ICMP_NE,
+                                      orig, modified,
+                                      "chk", next);
+
+    CheckingInstrs.insert(orig);
+    CheckingInstrs.insert(modified);
+    CheckingInstrs.insert(chkRes);
+
+    // set consitant name
+    orig->setName(chkRes->getName() + ".orig");
+    modified->setName(chkRes->getName() + ".mod");
+
+    return chkRes;
+}
+
+/// Check whether the bytes written by `SI` overlap the bytes read from
+/// `memAddr`, using integer compares only. Returns 0 if either access size
+/// is unknown
+Instruction *RedoBBBuilder::createRangeCheck(StoreInst *SI, Value *memAddr)
+{
+    Type *memTy = cast<PointerType>(memAddr->getType())->getElementType();
+    uint64_t memSize = pass->AA->getTypeStoreSize(memTy);
+    uint64_t stSize = pass->AA->getTypeStoreSize(SI->getValueOperand()->getType());
+    if (memSize == AliasAnalysis::UnknownSize || stSize == AliasAnalysis::UnknownSize) {
+        return 0;
+    }
+
+    LLVMContext &ctx = SI->getContext();
+    Type *intPtrTy = getIntPtrType(ctx);
+
+    // The range of a loop invariant address is computed once in the
+    // preheader. Addresses produced by a speculatively hoisted instruction
+    // may be redone, so they are read at the store.
+    std::pair<Value *, Value *> memRange;
+    if (isSpeculativeValue(memAddr)) {
+        memRange = createAddrRange(memAddr, memSize, intPtrTy, SI);
+    } else {
+        memRange = getInvariantAddrRange(memAddr, memSize, intPtrTy);
+    }
+
+    // %st.begin    = ptrtoint %storeAddr
+    // %st.end      = add %st.begin, storeSize
+    // the STORE we checking
+    std::pair<Value *, Value *> stRange =
+        createAddrRange(SI->getPointerOperand(), stSize, intPtrTy, SI);
+    return createOverlap(stRange, memRange, SI);
+}
+
+/// Build a test whether [addr, addr + size) overlaps [invAddr, invAddr +
+/// invSize) before `insertBefore`. The range of the loop invariant `invAddr`
+/// is computed once in the preheader
+Instruction *RedoBBBuilder::CreateOverlapCheck(Value *addr, uint64_t size,
+                                               Value *invAddr, uint64_t invSize,
+                                               Instruction *insertBefore)
+{
+    LLVMContext &ctx = insertBefore->getContext();
+    Type *intPtrTy = getIntPtrType(ctx);
+
+    std::pair<Value *, Value *> invRange = getInvariantAddrRange(invAddr, invSize, intPtrTy);
+    std::pair<Value *, Value *> range = createAddrRange(addr, size, intPtrTy, insertBefore);
+    return createOverlap(range, invRange, insertBefore);
+}
+
+/// Test whether two [begin, end) ranges overlap, before `insertBefore`
+Instruction *RedoBBBuilder::createOverlap(std::pair<Value *, Value *> a,
+                                          std::pair<Value *, Value *> b,
+                                          Instruction *insertBefore)
+{
+    // %chk.lo      = icmp ult %a.begin, %b.end
+    // %chk.hi      = icmp ult %b.begin, %a.end
+    // %chk         = and %chk.lo, %chk.hi
+    CmpInst *lo = CmpInst::Create(Instruction::ICmp, CmpInst::ICMP_ULT,
+                                  a.first, b.second, "chk.lo", insertBefore);
+    CmpInst *hi = CmpInst::Create(Instruction::ICmp, CmpInst::ICMP_ULT,
+                                  b.first, a.second, "chk.hi", insertBefore);
+    Instruction *chkRes = BinaryOperator::Create(Instruction::And, lo, hi, "chk",
+                                                 insertBefore);
+
+    CheckingInstrs.insert(lo);
+    CheckingInstrs.insert(hi);
+    CheckingInstrs.insert(chkRes);
+
+    return chkRes;
+}
+
+/// Compute [addr, addr + size) as integers before `insertBefore`
+std::pair<Value *, Value *> RedoBBBuilder::createAddrRange(Value *addr, uint64_t size,
+                                                          Type *intPtrTy,
+                                                          Instruction *insertBefore)
+{
+    Instruction *begin = new PtrToIntInst(addr, intPtrTy,
+                                          addr->getName() + ".begin", insertBefore);
+    Instruction *end = BinaryOperator::Create(Instruction::Add, begin,
+                                              ConstantInt::get(intPtrTy, size),
+                                              addr->getName() + ".end", insertBefore);
+    CheckingInstrs.insert(begin);
+    CheckingInstrs.insert(end);
+    return std::make_pair(begin, end);
+}
+
+/// Integer type wide enough to hold an address
+Type *RedoBBBuilder::getIntPtrType(LLVMContext &ctx) const
+{
+    return pass->TD ? (Type *)pass->TD->getIntPtrType(ctx)
+                    : (Type *)Type::getInt64Ty(ctx);
+}
+
+/// Whether `V` is, or is computed from, a speculatively hoisted instruction,
+/// and so may be redone in the loop
+bool RedoBBBuilder::isSpeculativeValue(Value *V) const
+{
+    Instruction *I = dyn_cast<Instruction>(V);
+    return I && pass->SpeculateHoisted.count(I);
+}
+
+/// Get [addr, addr + size) of a loop invariant `addr`, computed once in the
+/// preheader
+std::pair<Value *, Value *> RedoBBBuilder::getInvariantAddrRange(Value *addr, uint64_t size,
+                                                                Type *intPtrTy)
+{
+    std::pair<Value *, Value *> &cached = AddrRangeMap[addr];
+    if (!cached.first) {
+        cached = createAddrRange(addr, size, intPtrTy, pass->Preheader->getTerminator());
+    }
+    return cached;
+}
+
+/// Compute the lowest and highest address each store checked for `LD` may
+/// write to during the current loop. Returns false if some store address is
+/// not loop invariant or an affine, non-wrapping function of the iteration
+/// count, if the trip count can not be computed, or if the size of `LD` or
+/// of some store is unknown
+bool RedoBBBuilder::getStoreBounds(LoadInst &LD, SmallVectorImpl<StoreBounds> &bounds) const
+{
+    ScalarEvolution *SE = pass->SE;
+    Loop *L = pass->CurLoop;
+
+    // the address must not change in the loop
+    if (isSpeculativeValue(LD.getOperand(0))) { return false; }
+
+    AliasAnalysis *AA = pass->AA;
+    if (AA->getTypeStoreSize(LD.getType()) == AliasAnalysis::UnknownSize) { return false; }
+
+    SmallVector<StoreInst *, 8> stores;
+    for (auto pointerRec : pass->getAliasSetForLoadSrc(&LD)) {
+        collectStores(pointerRec.getValue(), stores);
+    }
+
+    const SCEV *btc = 0;
+    for (auto SI : stores) {
+        Value *ptr = SI->getPointerOperand();
+        if (!SE->isSCEVable(ptr->getType())) { return false; }
+        if (AA->getTypeStoreSize(SI->getValueOperand()->getType())
+            == AliasAnalysis::UnknownSize) {
+            return false;
+        }
+
+        const SCEV *S = SE->getSCEV(ptr);
+        StoreBounds b = { SI, S, S };
+        if (!SE->isLoopInvariant(S, L)) {
+            const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(S);
+            if (!AR || AR->getLoop() != L || !AR->isAffine()
+                || AR->getNoWrapFlags() == SCEV::FlagAnyWrap) {
+                return false;
             }
+            const SCEVConstant *step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(*SE));
+            if (!step) { return false; }
+
+            if (!btc) {
+                btc = SE->getBackedgeTakenCount(L);
+                if (isa<SCEVCouldNotCompute>(btc)) { return false; }
+            }
+
+            // both bounds are expanded before the loop, so neither may be
+            // the recurrence itself
+            const SCEV *first = AR->getStart();
+            const SCEV *last = AR->evaluateAtIteration(btc, *SE);
+            if (step->getValue()->isNegative()) {
+                b.Low = last;
+                b.High = first;
+            } else {
+                b.Low = first;
+                b.High = last;
+            }
+        }
+        bounds.push_back(b);
+    }
+    return true;
+}
+
+/// Build, before the loop, the test whether any store checked for `LD` may
+/// overlap `LD`'s memory at some iteration. Returns 0 if the stores can not
+/// be bounded (see getStoreBounds)
+Value *RedoBBBuilder::createVersionCheck(LoadInst &LD)
+{
+    SmallVector<StoreBounds, 8> bounds;
+    if (!getStoreBounds(LD, bounds)) { return 0; }
+
+    Value *memAddr = LD.getOperand(0);
+    uint64_t memSize = pass->AA->getTypeStoreSize(LD.getType());
+
+    LLVMContext &ctx = LD.getContext();
+    Type *intPtrTy = getIntPtrType(ctx);
+    std::pair<Value *, Value *> memRange = getInvariantAddrRange(memAddr, memSize, intPtrTy);
+
+    // For each store
+    // %low         = ptrtoint <first address stored to>
+    // %high        = ptrtoint <last address stored to>
+    // %high.end    = add %high, storeSize
+    // %ver.lo      = icmp ult %low, %mem.end
+    // %ver.hi      = icmp ult %mem.begin, %high.end
+    // %ver         = and %ver.lo, %ver.hi
+    // all merged with or
+    Instruction *insertPt = pass->getOrCreatePostPreheader()->getTerminator();
+    SCEVExpander expander(*pass->SE, "slicm");
+    Value *overlap = ConstantInt::getFalse(ctx);
+    for (auto b : bounds) {
+        Value *ptr = b.SI->getPointerOperand();
+        uint64_t stSize = pass->AA->getTypeStoreSize(b.SI->getValueOperand()->getType());
+
+        Value *low = expander.expandCodeFor(b.Low, ptr->getType(), insertPt);
+        Value *high = expander.expandCodeFor(b.High, ptr->getType(), insertPt);
+        low = new PtrToIntInst(low, intPtrTy, ptr->getName() + ".low", insertPt);
+        high = new PtrToIntInst(high, intPtrTy, ptr->getName() + ".high", insertPt);
+        Value *highEnd = BinaryOperator::Create(Instruction::Add, high,
+                                                ConstantInt::get(intPtrTy, stSize),
+                                                ptr->getName() + ".high.end", insertPt);
+
+        CmpInst *lo = CmpInst::Create(Instruction::ICmp, CmpInst::ICMP_ULT,
+                                      low, memRange.second, "ver.lo", insertPt);
+        CmpInst *hi = CmpInst::Create(Instruction::ICmp, CmpInst::ICMP_ULT,
+                                      memRange.first, highEnd, "ver.hi", insertPt);
+        Value *res = BinaryOperator::Create(Instruction::And, lo, hi, "ver", insertPt);
+        overlap = BinaryOperator::Create(Instruction::Or, overlap, res, "ver.any", insertPt);
+    }
+
+    DEBUG(dbgs() << "        Versioned '" << LD.getName() << "' against "
+                << bounds.size() << " stores\n");
+
+    return overlap;
+}
+
+/// Collect the stores through `val` that insertCheck would instrument
+void RedoBBBuilder::collectStores(Value *val, SmallVectorImpl<StoreInst *> &stores) const
+{
+    for (auto it = val->use_begin(), ite = val->use_end(); it != ite; it++) {
+        StoreInst *SI = dyn_cast<StoreInst>(*it);
+        // stores *of* the pointer are not interesting
+        if (SI && SI->getPointerOperand() == val) {
+            // stores in subloops may change the memory as well
+            if (!pass->CurLoop->contains(SI)) { continue; }
+
+            // skip instruction we don't interested in
+            if (!shouldCheck(*SI)) { continue; }
+
+            stores.push_back(SI);
+        }
+    }
+}
+
+/// Find the existing check of `memAddr` at `SI`, if any
+Instruction *RedoBBBuilder::findCheck(StoreInst *SI, Value *memAddr) const
+{
+    auto it = StoreToCheckMap.find(SI);
+    if (it == StoreToCheckMap.end()) { return 0; }
+
+    for (auto pair : it->second) {
+        if (pair.first == memAddr) {
+            return pair.second;
+        }
+    }
+    return 0;
+}
+
+/// Estimate the dynamic instruction count CreateRedoBB would add for `LD`
+/// from the profiled block counts, or ProfileInfo::MissingValue if some
+/// count is unknown
+double RedoBBBuilder::EstimateCheckCost(Instruction &I)
+{
+    double homeCount = pass->getExecutionCount(I.getParent());
+    if (homeCount == ProfileInfo::MissingValue) { return ProfileInfo::MissingValue; }
+
+    double cost = homeCount * HomeCheckCost;
+
+    // a call only gets its flag set at each clobbering store
+    if (CallInst *CI = dyn_cast<CallInst>(&I)) {
+        SmallVector<StoreInst *, 8> stores;
+        collectCallClobbers(*CI, stores);
+        for (auto SI : stores) {
+            double count = pass->getExecutionCount(SI->getParent());
+            if (count == ProfileInfo::MissingValue) { return ProfileInfo::MissingValue; }
+            cost += count * FlagUpdateCost;
+        }
+        return cost;
+    }
+    LoadInst &LD = cast<LoadInst>(I);
+
+    // a versioned flag costs nothing in the loop besides the branch
+    SmallVector<StoreBounds, 8> bounds;
+    if (Versioning && getStoreBounds(LD, bounds)) { return cost; }
 
-            DEBUG(dbgs() << "            Check result stored to " << flag->getName() << "\n");
-            // merge old value and new value with or
-            //
-            // %oldflgval   = load %flag
-            // %newflgval   = or %oldflgval, %chkRes
-            // store  %newflgval, %flag
-            // the next instr after STORE we checking
-            Instruction *next = chkRes->getNextNode();
-            LoadInst *oldflgval = new LoadInst(flag, flag->getName() + ".oldval", next);
-            auto *newflgval = BinaryOperator::Create(Instruction::Or,
-                                                     oldflgval, chkRes,
-                                                     flag->getName() + ".newval",
-                                                     next);
-            StoreInst *st = new StoreInst(newflgval, flag, next);
-            CheckingInstrs.insert(oldflgval);
-            CheckingInstrs.insert(newflgval);
-            CheckingInstrs.insert(st);
-
-            CheckToFlagMap[pair].push_back(flag);
+    // the range checks of an alias set are shared by all of its loads,
+    // only the flag updates are added for another one
+    bool shared = CheckMode == RangeCheck && !isSpeculativeValue(LD.getOperand(0))
+        && AliasSetToLoads.count(&pass->getAliasSetForLoadSrc(&LD));
+
+    SmallVector<StoreInst *, 8> stores;
+    for (auto pointerRec : pass->getAliasSetForLoadSrc(&LD)) {
+        collectStores(pointerRec.getValue(), stores);
+    }
+    for (auto SI : stores) {
+        double count = pass->getExecutionCount(SI->getParent());
+        if (count == ProfileInfo::MissingValue) { return ProfileInfo::MissingValue; }
+
+        // a check of the same address made for another load is shared
+        unsigned perStore = FlagUpdateCost;
+        if (!shared && !findCheck(SI, LD.getOperand(0))) {
+            perStore += CheckMode == RangeCheck ? RangeCheckCost : ValueCheckCost;
         }
+        cost += count * perStore;
     }
+    return cost;
 }
 
-/// Create redo/rest BB struction at LoadInst `I`
+/// Create redo/rest BB struction at load or read only call `I`
 /// check flag is created if necessary
-BasicBlock *RedoBBBuilder::CreateRedoBB(LoadInst &I)
+BasicBlock *RedoBBBuilder::CreateRedoBB(Instruction &I)
 {
-    assert(LdToRedoBB[&I] == 0 && "CreateRedoBB should only be called once on each LoadInst");
+    assert(!SpecToRedo.count(&I) && "CreateRedoBB should only be called once on each instruction");
 
     Value *flag = createCheckFlag(I);
 
@@ -136,7 +591,6 @@ BasicBlock *RedoBBBuilder::CreateRedoBB(LoadInst &I)
     BasicBlock *homeBB = I.getParent();
     BasicBlock *redoBB = SplitBlock(homeBB, &I, pass);
     redoBB->setName(homeBB->getName() + ".redo");
-    LdToRedoBB[&I] = redoBB;
 
     assert(isCurrentTopLoop(redoBB) && "LoopInfo should be updated");
 
@@ -150,24 +604,30 @@ BasicBlock *RedoBBBuilder::CreateRedoBB(LoadInst &I)
 
     BranchInst::Create(redoBB, restBB, reg, homeBB);
 
-    // reset flag in redoBB
-    new StoreInst(ConstantInt::getFalse(I.getContext()),
-                  flag, redoBB->getTerminator());
+    // reset flag in redoBB, a versioned flag keeps its value
+    Value *reset = VersionedFlags.lookup(flag);
+    if (!reset) {
+        reset = ConstantInt::getFalse(I.getContext());
+    }
+    new StoreInst(reset, flag, redoBB->getTerminator());
+
+    RedoInfo info = { flag, redoBB };
+    SpecToRedo[&I] = info;
 
-    // add load itself to redoBB
+    // add the hoisted instruction itself to redoBB
     AddToRedoBB(&I, &I);
 
     return redoBB;
 }
 
-/// Add instruction `Inst` to `LD`'s redoBB
-void RedoBBBuilder::AddToRedoBB(Instruction *Inst, LoadInst *LD)
+/// Add instruction `Inst` to `Spec`'s redoBB
+void RedoBBBuilder::AddToRedoBB(Instruction *Inst, Instruction *Spec)
 {
-    BasicBlock *redoBB = LdToRedoBB[LD];
+    BasicBlock *redoBB = SpecToRedo.lookup(Spec).RedoBB;
     assert(redoBB && "Create redoBB first!");
 
     DEBUG(dbgs() << "        Adding '" << Inst->getName() << "' to redoBB '" << redoBB->getName()
-                << "', belongs to '" << LD->getName() << "'\n");
+                << "', belongs to '" << Spec->getName() << "'\n");
 
     auto newInst = Inst->clone();
     if (!Inst->getName().empty()) {
@@ -195,12 +655,9 @@ Value *RedoBBBuilder::createStackValue(Instruction *Inst)
         return var;
     }
 
-    BasicBlock *prepre = pass->getOrCreatePrePreheader();
     BasicBlock *postpre = pass->getOrCreatePostPreheader();
 
-    AllocaInst *var = new AllocaInst(Inst->getType(),
-                                        Inst->getName() + ".var",
-                                        prepre->getTerminator());
+    AllocaInst *var = createEntryAlloca(Inst->getType(), Inst->getName() + ".var");
     new StoreInst(Inst, var, postpre->getTerminator());
     InstToStvarMap[Inst] = var;
 
@@ -217,6 +674,33 @@ void RedoBBBuilder::PatchOutputs()
     }
 }
 
+/// Rewrite the check flags into SSA values threaded through PHIs, so no
+/// flag loads or stores are left in the loop
+void RedoBBBuilder::PromoteFlags()
+{
+    for (auto F : Flags) {
+        AllocaInst *flag = cast<AllocaInst>(F);
+
+        // every use is a load/store of the flag made by us
+        SmallVector<Instruction *, 16> insts;
+        for (auto it = flag->use_begin(), ite = flag->use_end(); it != ite; it++) {
+            insts.push_back(cast<Instruction>(*it));
+        }
+
+        DEBUG(dbgs() << "    Promoting flag '" << flag->getName() << "' with "
+                    << insts.size() << " loads and stores\n");
+
+        SSAUpdater SSA;
+        FlagPromoter(insts, SSA, flag->getName(), CheckingInstrs).run(insts);
+        flag->eraseFromParent();
+    }
+
+    Flags.clear();
+    SpecToRedo.clear();
+    CheckToFlagMap.clear();
+    VersionedFlags.clear();
+}
+
 /// Change all consumers of `I` to use stack variable `var` instead
 void RedoBBBuilder::patchOutputFor(Instruction *I, Value *var)
 {
@@ -246,7 +730,15 @@ void RedoBBBuilder::patchOutputFor(Instruction *I, Value *var)
 bool RedoBBBuilder::IsRedoCode(Instruction& I) const
 {
     auto BB = I.getParent();
-    return IsRedoBB(BB) || pass->isPrePre(BB) || pass->isPostPre(BB);
+    return IsRedoBB(BB) || pass->isPostPre(BB);
+}
+
+/// Create an alloca at the start of the function's entry block. Allocas in
+/// a preheader would grow the stack on every iteration of an enclosing loop
+AllocaInst *RedoBBBuilder::createEntryAlloca(Type *ty, const Twine &name)
+{
+    BasicBlock &entry = pass->Preheader->getParent()->getEntryBlock();
+    return new AllocaInst(ty, name, entry.getFirstInsertionPt());
 }
 
 bool RedoBBBuilder::isCurrentTopLoop(Instruction& I) const
@@ -3,7 +3,10 @@
 
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/AliasSetTracker.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Support/Debug.h"
@@ -19,7 +22,7 @@ class RedoBBBuilder
 {
     typedef std::pair<Instruction*, Value*> InstrPair;
     // check result performed on memaddr
-    typedef std::pair<Value*, CmpInst*> Check;
+    typedef std::pair<Value*, Instruction*> Check;
     struct first_eq_with
     {
         first_eq_with(Instruction *other) : mine(other) { }
@@ -29,8 +32,21 @@ class RedoBBBuilder
 
     SLICM *pass;
 
-    DenseMap<LoadInst *, Value *> LdToFlagMap;
-    DenseMap<LoadInst*, BasicBlock *> LdToRedoBB;
+    /// The check flag and redoBB of a speculatively hoisted instruction.
+    /// Every hoisted instruction has its own, so a home only redoes its
+    /// own instruction, at the point the original program executed it
+    struct RedoInfo
+    {
+        Value *Flag;
+        BasicBlock *RedoBB;
+    };
+
+    DenseMap<Instruction *, RedoInfo> SpecToRedo;
+    SmallVector<Value *, 8> Flags;
+
+    // In range mode, loads from loop invariant addresses of one alias set
+    // share their checks, see FinalizeChecks
+    MapVector<AliasSet *, SmallVector<LoadInst *, 4> > AliasSetToLoads;
 
     DenseMap<Instruction *, Value *> InstToStvarMap;
 
@@ -39,19 +55,48 @@ class RedoBBBuilder
 
     DenseSet<Instruction *> CheckingInstrs;
 
+    // [begin, end) of loop invariant addresses, computed in the preheader
+    DenseMap<Value *, std::pair<Value *, Value *>> AddrRangeMap;
+
+    // flags decided before the loop, and the value they keep
+    DenseMap<Value *, Value *> VersionedFlags;
+
+    // the lowest and highest address a store writes to in the loop
+    struct StoreBounds
+    {
+        StoreInst *SI;
+        const SCEV *Low;
+        const SCEV *High;
+    };
+
 public:
+    /// How an aliasing store is checked against a hoisted load
+    enum CheckKind {
+        ValueCheck,     // reload the value around the store and compare
+        RangeCheck      // compare the address ranges of the two accesses
+    };
+
     RedoBBBuilder(SLICM *pass) : pass(pass) { }
 
-    /// Create redo/rest BB struction at LoadInst `I`
+    /// Create redo/rest BB struction at load or read only call `I`
     /// check flag is created if necessary
-    BasicBlock *CreateRedoBB(LoadInst& I);
+    BasicBlock *CreateRedoBB(Instruction& I);
+
+    /// Add instruction `Inst` to `Spec`'s redoBB
+    void AddToRedoBB(Instruction *Inst, Instruction *Spec);
 
-    /// Add instruction `Inst` to `LD`'s redoBB
-    void AddToRedoBB(Instruction *Inst, LoadInst *LD);
+    /// Build the checks shared by the loads of each alias set. Call once
+    /// all speculative hoisting for the current loop is done
+    void FinalizeChecks();
 
     /// Patch consumers of each Instruction added in redoBB to use their stack value instead
     void PatchOutputs();
 
+    /// Rewrite the check flags into SSA values threaded through PHIs, so no
+    /// flag loads or stores are left in the loop. Call once all redoBBs and
+    /// checks for the current loop are built.
+    void PromoteFlags();
+
     bool IsRedoCode(Instruction &I) const;
 
     bool ShouldIgnoreForHoist(Instruction &I) const
@@ -59,20 +104,95 @@ public:
         return IsRedoCode(I) || isCheckingCode(I);
     }
 
+    /// Instructions executed per aliasing store for a new check: two loads
+    /// and an icmp, or an add, two icmps and an and (ptrtoint is free); and
+    /// for merging a check result into a flag (an or, once flags are promoted)
+    static const unsigned ValueCheckCost = 3;
+    static const unsigned RangeCheckCost = 4;
+    static const unsigned FlagUpdateCost = 1;
+    /// Instructions executed at the home of a hoisted load (branch on flag)
+    static const unsigned HomeCheckCost = 1;
+    /// Instructions executed per redone instruction (clone, store to stack
+    /// value), plus the branch back from the redoBB
+    static const unsigned RedoInstCost = 2;
+    static const unsigned RedoFixedCost = 1;
+
+    /// Build a test whether [addr, addr + size) overlaps the loop invariant
+    /// [invAddr, invAddr + invSize) before `insertBefore`
+    Instruction *CreateOverlapCheck(Value *addr, uint64_t size,
+                                    Value *invAddr, uint64_t invSize,
+                                    Instruction *insertBefore);
+
+    /// Estimate the dynamic instruction count CreateRedoBB would add for `I`
+    /// from the profiled block counts, or ProfileInfo::MissingValue if some
+    /// count is unknown
+    double EstimateCheckCost(Instruction &I);
+
 private:
-    /// Create check flag for `LD`, which is set to true if
-    /// the memory at `LD.getOperand(0)` is changed
-    Value *createCheckFlag(LoadInst &I);
+    /// Create check flag for `I`, which is set to true if
+    /// the memory `I` reads is changed
+    Value *createCheckFlag(Instruction &I);
+
+    /// Merge the check result `chkRes` into `flag`, right after the check
+    void insertFlagUpdate(Instruction *chkRes, Value *flag);
+
+    /// Integer type wide enough to hold an address
+    Type *getIntPtrType(LLVMContext &ctx) const;
+
+    /// Whether `V` is computed by a speculatively hoisted instruction
+    bool isSpeculativeValue(Value *V) const;
+
+    /// Set `flag` after every store that may write memory read by `CI`
+    void insertCallCheck(CallInst &CI, Value *flag);
+
+    /// Collect the stores in the loop that may write memory read by `CI`
+    void collectCallClobbers(CallInst &CI, SmallVectorImpl<StoreInst *> &stores) const;
 
     /// check if value in memory at `memAddr` was changed when accessing `val`, store result into flag
     void insertCheck(Value *val, Value *memAddr, Value* flag);
 
+    /// Check whether `SI` changed the value in memory at `memAddr`
+    Instruction *createValueCheck(StoreInst *SI, Value *memAddr);
+
+    /// Check whether the bytes written by `SI` overlap those read from `memAddr`
+    Instruction *createRangeCheck(StoreInst *SI, Value *memAddr);
+
+    /// Test whether two [begin, end) ranges overlap, before `insertBefore`
+    Instruction *createOverlap(std::pair<Value *, Value *> a,
+                               std::pair<Value *, Value *> b,
+                               Instruction *insertBefore);
+
+    /// Compute [addr, addr + size) as integers before `insertBefore`
+    std::pair<Value *, Value *> createAddrRange(Value *addr, uint64_t size,
+                                                Type *intPtrTy,
+                                                Instruction *insertBefore);
+
+    /// Get [addr, addr + size) of a loop invariant `addr`, computed in the preheader
+    std::pair<Value *, Value *> getInvariantAddrRange(Value *addr, uint64_t size,
+                                                      Type *intPtrTy);
+
+    /// Bound the addresses written by the stores checked for `LD`, if they
+    /// are all affine in the current loop
+    bool getStoreBounds(LoadInst &LD, SmallVectorImpl<StoreBounds> &bounds) const;
+
+    /// Test before the loop whether any store checked for `LD` may overlap it
+    Value *createVersionCheck(LoadInst &LD);
+
+    /// Collect the stores through `val` that insertCheck would instrument
+    void collectStores(Value *val, SmallVectorImpl<StoreInst *> &stores) const;
+
+    /// Find the existing check of `memAddr` at `SI`, if any
+    Instruction *findCheck(StoreInst *SI, Value *memAddr) const;
+
     /// Create a stack value to store `Inst`'s output
     Value *createStackValue(Instruction *Inst);
 
     /// Change all consumers of `I` to use stack variable `var` instead
     void patchOutputFor(Instruction *I, Value *var);
 
+    /// Create an alloca in the function's entry block
+    AllocaInst *createEntryAlloca(Type *ty, const Twine &name);
+
     bool isCurrentTopLoop(Instruction &I) const;
     bool isCurrentTopLoop(BasicBlock *BB) const;
 
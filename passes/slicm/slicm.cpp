@@ -79,11 +79,26 @@ STATISTIC(NumHoisted,    "Number of instructions hoisted out of loop");
 STATISTIC(NumMovedLoads, "Number of load insts hoisted or sunk");
 STATISTIC(NumMovedCalls, "Number of call insts hoisted or sunk");
 STATISTIC(NumPromoted,   "Number of memory locations promoted to registers");
+STATISTIC(NumSpecAccepted, "Number of speculative hoist candidates accepted");
+STATISTIC(NumSpecRejected, "Number of speculative hoist candidates rejected");
+STATISTIC(NumSunkModLoads, "Number of loads from modified memory sunk out of loop");
+STATISTIC(NumSpecPromoted, "Number of may-aliased memory locations promoted to registers");
+STATISTIC(NumPromoteGuards, "Number of accesses guarded for speculative promotion");
 
 static cl::opt<bool>
 DisablePromotion("disable-slicm-promotion", cl::Hidden,
                  cl::desc("Disable memory promotion in SLICM pass"));
 
+static cl::opt<bool>
+SpeculativePromotion("slicm-speculative-promotion", cl::init(false),
+                     cl::desc("Promote memory that may be aliased in the loop, "
+                              "guarding the aliasing accesses"));
+
+static cl::opt<double>
+ConflictThreshold("slicm-conflict-threshold", cl::init(0.1),
+                  cl::desc("Maximum profiled store-to-load conflict rate of a "
+                           "load that is speculatively hoisted"));
+
 char SLICM::ID = 0;
 /*
  * // 583 - commented out INITIALIZE_ macros & createSLICMPass
@@ -103,7 +118,6 @@ void SLICM::ClearState()
 {
     CurLoop = 0;
     Preheader = 0;
-    PrePreheader = 0;
     PostPreheader = 0;
 
     SpeculateHoisted.clear();
@@ -126,6 +140,9 @@ bool SLICM::runOnLoop(Loop *L, LPPassManager &LPM)
 
     TD = getAnalysisIfAvailable<DataLayout>();
     TLI = &getAnalysis<TargetLibraryInfo>();
+    PI = &getAnalysis<ProfileInfo>();
+    LAMP = &getAnalysis<LAMPLoadProfile>();
+    SE = &getAnalysis<ScalarEvolution>();
 
     CurAST = new AliasSetTracker(*AA);
     // Collect Alias info from subloops.
@@ -149,8 +166,7 @@ bool SLICM::runOnLoop(Loop *L, LPPassManager &LPM)
     // Get the preheader block to move instructions into...
     Preheader = L->getLoopPreheader();
 
-    // PrePreheader and PostPreheader are lazily created
-    PrePreheader = 0;
+    // PostPreheader is lazily created
     PostPreheader = 0;
 
     // Loop over the body of this loop, looking for calls, invokes, and stores.
@@ -193,7 +209,9 @@ bool SLICM::runOnLoop(Loop *L, LPPassManager &LPM)
     }
     if (Preheader) {
         HoistRegion(DT->getNode(L->getHeader()));
+        RBBB->FinalizeChecks();
         RBBB->PatchOutputs();
+        RBBB->PromoteFlags();
     }
 
     // Now that all loop invariants have been removed from the loop, promote any
@@ -212,6 +230,11 @@ bool SLICM::runOnLoop(Loop *L, LPPassManager &LPM)
     // Clear out loops state information for the next iteration
     ClearState();
 
+    // Outer loops may ask for trip counts again, don't let them see ours
+    if (Changed) {
+        SE->forgetLoop(L);
+    }
+
     // If this loop is nested inside of another one, save the alias information
     // for when we process the outer loop.
     if (L->getParentLoop()) {
@@ -265,9 +288,12 @@ void SLICM::SinkRegion(DomTreeNode *N)
         // outside of the loop.  In this case, it doesn't even matter if the
         // operands of the instruction are loop invariant.
         //
-        if (isNotUsedInLoop(I) && canSinkOrHoistInst(I)) {
-            ++II;
-            sink(I);
+        if (isNotUsedInLoop(I)) {
+            bool ModifiedLoad = false;
+            if (canSinkOrHoistInst(I) || (ModifiedLoad = canSinkModifiedLoad(I))) {
+                ++II;
+                sink(I, ModifiedLoad);
+            }
         }
     }
 }
@@ -359,7 +385,7 @@ void SLICM::maybeResultOfSpeculativeHoist(Instruction &I)
 {
     bool first = true;
 
-    SmallVector<LoadInst*, 2> depends;
+    SmallVector<Instruction*, 2> depends;
     for (unsigned i = 0, e = I.getNumOperands(); i != e; i++) {
         if (Instruction *operInst = dyn_cast<Instruction>(I.getOperand(i))) {
             if (SpeculateHoisted.count(operInst)) {
@@ -368,9 +394,9 @@ void SLICM::maybeResultOfSpeculativeHoist(Instruction &I)
                     DEBUG(dbgs() << "    (" << I << "  ) may be result of speculative hoist\n");
                 }
                 DEBUG(dbgs() << "    Operand '" << operInst->getName() << "' depends on speculative hoisted load\n");
-                for (auto ld : SpeculateHoisted[operInst]) {
-                    RBBB->AddToRedoBB(&I, ld);
-                    depends.push_back(ld);
+                for (auto spec : SpeculateHoisted[operInst]) {
+                    RBBB->AddToRedoBB(&I, spec);
+                    depends.push_back(spec);
                 }
             }
         }
@@ -451,10 +477,16 @@ bool SLICM::canSinkOrHoistInst(Instruction& I, bool *speculative)
                 }
             }
             if (!FoundMod) { return true; }
-        }
 
-        // FIXME: This should use mod/ref information to see if we can hoist or
-        // sink the call.
+            // Otherwise the call can be redone whenever a store in the loop
+            // may have changed what it reads
+            if (speculative && canSpeculativeHoist(*CI)) {
+                I.setName("call");
+                DEBUG(dbgs() << "    Found speculative hoistable instruction (" << I << "  )\n");
+                *speculative = true;
+                return true;
+            }
+        }
 
         return false;
     }
@@ -481,9 +513,324 @@ bool SLICM::isHoistableInstr(Instruction &I)
     || isa<InsertValueInst>(I);
 }
 
-bool SLICM::canSpeculativeHoist(LoadInst& I)
+bool SLICM::canSpeculativeHoist(Instruction& I)
+{
+    if (RBBB->ShouldIgnoreForHoist(I)) {
+        return false;
+    }
+
+    // The redo block reproduces the value, it must have one
+    if (I.getType()->isVoidTy()) {
+        return false;
+    }
+
+    // Only stores get checks, anything else that writes the memory would go
+    // unnoticed
+    if (hasUncheckedWriter(I)) {
+        DEBUG(dbgs() << "    (" << I << "  ) may be clobbered by an unchecked "
+                     << "instruction, not hoisting\n");
+        return false;
+    }
+
+    // Hoisting a load that conflicts on most iterations only makes the redo
+    // block run every time, which is slower than leaving the load alone.
+    double Rate = getConflictRate(I);
+    if (Rate > ConflictThreshold) {
+        DEBUG(dbgs() << "    Conflict rate " << Rate << " of (" << I
+                     << "  ) is above threshold, not hoisting\n");
+        ++NumSpecRejected;
+        return false;
+    }
+
+    if (!isProfitableSpeculativeHoist(I)) {
+        ++NumSpecRejected;
+        return false;
+    }
+
+    ++NumSpecAccepted;
+    return true;
+}
+
+/// hasUncheckedWriter - Return true if something in the loop other than a
+/// store may write memory that `I` reads.  Only stores, including those in
+/// subloops, get checks from RedoBBBuilder.
+///
+bool SLICM::hasUncheckedWriter(Instruction &I)
+{
+    CallInst *CI = dyn_cast<CallInst>(&I);
+    AliasAnalysis::Location Loc;
+    if (LoadInst *LD = dyn_cast<LoadInst>(&I)) {
+        Loc = AA->getLocation(LD);
+    }
+
+    for (Loop::block_iterator BI = CurLoop->block_begin(), BE = CurLoop->block_end();
+         BI != BE; ++BI) {
+        for (BasicBlock::iterator W = (*BI)->begin(), E = (*BI)->end(); W != E; ++W) {
+            if (!W->mayWriteToMemory() || RBBB->ShouldIgnoreForHoist(*W)) {
+                continue;
+            }
+            // stores, in subloops too, are checked by RedoBBBuilder
+            if (isa<StoreInst>(W)) {
+                continue;
+            }
+
+            bool Clobbers;
+            if (!CI) {
+                Clobbers = AA->getModRefInfo(&*W, Loc) & AliasAnalysis::Mod;
+            } else if (isa<CallInst>(W) || isa<InvokeInst>(W)) {
+                Clobbers = AA->getModRefInfo(ImmutableCallSite(&*W), ImmutableCallSite(CI))
+                           & AliasAnalysis::Mod;
+            } else {
+                Clobbers = true;
+            }
+            if (Clobbers) { return true; }
+        }
+    }
+    return false;
+}
+
+/// isProfitableSpeculativeHoist - Weigh the instructions saved by hoisting `Spec`
+/// against the checks and redo work it adds, using profiled block counts.
+/// Each execution of the home block saves the hoisted chain, less the stack
+/// reloads left in front of its remaining users; the hoisted copy still runs
+/// once per loop entry.  Against that, every aliasing store runs its check,
+/// every home execution tests the flag, and every conflict re-executes the
+/// chain in the redo block.
+///
+bool SLICM::isProfitableSpeculativeHoist(Instruction &Spec)
+{
+    double HomeCount = getExecutionCount(Spec.getParent());
+    double CheckCost = RBBB->EstimateCheckCost(Spec);
+    if (HomeCount == ProfileInfo::MissingValue
+        || CheckCost == ProfileInfo::MissingValue) {
+        DEBUG(dbgs() << "    No profile for (" << Spec << "  ), assuming profitable\n");
+        return true;
+    }
+
+    double Entries = getExecutionCount(Preheader);
+    if (Entries == ProfileInfo::MissingValue) {
+        Entries = 0;
+    }
+
+    unsigned Reloads = 0;
+    unsigned Chain = getHoistChain(Spec, Reloads);
+    double PerExecution = Chain > Reloads ? Chain - Reloads : 0;
+    double Saved = std::max(0.0, HomeCount - Entries) * PerExecution;
+
+    double RedoCost = getConflictRate(Spec) * HomeCount
+                      * (Chain * RedoBBBuilder::RedoInstCost
+                         + RedoBBBuilder::RedoFixedCost);
+    double Cost = CheckCost + RedoCost;
+
+    DEBUG(dbgs() << "    Cost model for (" << Spec << "  ): saves " << Saved
+                 << " (chain " << Chain << ", reloads " << Reloads
+                 << ", executed " << HomeCount << ", entered " << Entries
+                 << "), costs " << Cost << " (checks " << CheckCost
+                 << ", redo " << RedoCost << ") -> "
+                 << (Saved > Cost ? "accept" : "reject") << "\n");
+    return Saved > Cost;
+}
+
+/// getHoistChain - Return the number of instructions that would leave the loop
+/// together with `Spec`: the instruction itself and every user that becomes loop
+/// invariant once it is hoisted.  `Reloads` counts the in-loop users left
+/// behind; PatchOutputs puts a load of the stack value in front of each.
+///
+unsigned SLICM::getHoistChain(Instruction &Spec, unsigned &Reloads)
+{
+    SmallPtrSet<Instruction *, 16> Chain;
+    SmallVector<Instruction *, 16> Worklist;
+    Chain.insert(&Spec);
+    Worklist.push_back(&Spec);
+    Reloads = 0;
+
+    while (!Worklist.empty()) {
+        Instruction *I = Worklist.pop_back_val();
+        for (Value::use_iterator UI = I->use_begin(), E = I->use_end(); UI != E; ++UI) {
+            Instruction *User = cast<Instruction>(*UI);
+            if (!CurLoop->contains(User) || Chain.count(User)) { continue; }
+
+            bool Invariant = isHoistableInstr(*User)
+                             && isSafeToExecuteUnconditionally(*User);
+            for (unsigned i = 0, e = User->getNumOperands(); Invariant && i != e; ++i) {
+                Value *Op = User->getOperand(i);
+                Instruction *OpI = dyn_cast<Instruction>(Op);
+                Invariant = CurLoop->isLoopInvariant(Op) || (OpI && Chain.count(OpI));
+            }
+
+            if (Invariant) {
+                Chain.insert(User);
+                Worklist.push_back(User);
+            } else {
+                ++Reloads;
+            }
+        }
+    }
+    return Chain.size();
+}
+
+/// getConflictRate - Return the fraction of executions of `I` that read a
+/// value written by a store from within the current loop, as measured by the
+/// LAMP dependence profile.  Instructions without any recorded dependence in
+/// this loop (including everything, when no profile was loaded) get 0.
+///
+double SLICM::getConflictRate(Instruction &I)
+{
+    BasicBlock *Header = CurLoop->getHeader();
+
+    // A dependence is attributed to the innermost loop whose current
+    // invocation began before the store, so stores in subloops of CurLoop are
+    // counted here as well.
+    double Conflicts = LAMP->hasBinaryProfile() ? getProfiledConflicts(I, Header)
+                                                : getParsedConflicts(I, Header);
+    if (Conflicts == 0) {
+        return 0.0;
+    }
+
+    double Count = getExecutionCount(I.getParent());
+    if (Count == ProfileInfo::MissingValue) {
+        Count = getExecutionCount(Header);
+    }
+    // Conflicts were observed but we can't tell how often `I` runs: assume
+    // the worst.
+    if (Count <= 0) {
+        return 1.0;
+    }
+    return std::min(1.0, Conflicts / Count);
+}
+
+static bool recordLoadLess(const lamp_profile_record_t &R, unsigned int Load)
+{
+    return R.load < Load;
+}
+
+static bool loadRecordLess(unsigned int Load, const lamp_profile_record_t &R)
+{
+    return Load < R.load;
+}
+
+/// getProfiledConflicts - Sum the dependences into `I` recorded for the loop
+/// headed by `Header`, reading the loop's records from the mapped binary
+/// profile.  They are sorted by load, so `I`'s are found by binary search.
+///
+double SLICM::getProfiledConflicts(Instruction &I, BasicBlock *Header)
+{
+    std::map<BasicBlock *, unsigned int>::const_iterator Loop = LAMP->LoopToIdMap.find(Header);
+    std::map<Instruction *, unsigned int>::const_iterator Load = LAMP->InstToIdMap.find(&I);
+    const lamp_profile_record_t *Begin, *End;
+    if (Loop == LAMP->LoopToIdMap.end() || Load == LAMP->InstToIdMap.end()
+        || !LAMP->getLoopRecords(Loop->second, Begin, End)) {
+        return 0.0;
+    }
+
+    const lamp_profile_record_t *First = std::lower_bound(Begin, End, Load->second, recordLoadLess);
+    const lamp_profile_record_t *Last = std::upper_bound(First, End, Load->second, loadRecordLess);
+    double Conflicts = 0;
+    for (const lamp_profile_record_t *R = First; R != Last; ++R) {
+        // the text loader skips stores it can't map to an instruction too
+        std::map<unsigned int, Instruction *>::const_iterator Store = LAMP->IdToInstMap.find(R->store);
+        if (Store == LAMP->IdToInstMap.end() || Store->second == NULL) { continue; }
+        Conflicts += R->total_count * LAMP->SampleScale;
+    }
+    return Conflicts;
+}
+
+/// getParsedConflicts - Sum the dependences into `I` recorded for the loop
+/// headed by `Header`, from the maps built when a text profile was read.
+///
+double SLICM::getParsedConflicts(Instruction &I, BasicBlock *Header)
+{
+    if (!LAMP->LoopToDepSetMap.count(Header)) {
+        return 0.0;
+    }
+
+    double Conflicts = 0;
+    for (auto dep : LAMP->LoopToDepSetMap[Header]) {
+        if (dep->first == &I) {
+            Conflicts += LAMP->DepToTimesMap[dep];
+        }
+    }
+    return Conflicts;
+}
+
+/// getExecutionCount - Return the profiled execution count of `BB`.  Blocks
+/// we created by splitting (.rest, pre-headers) have no count of their own,
+/// so walk back to the block they were split from.
+///
+double SLICM::getExecutionCount(BasicBlock *BB)
 {
-    return !RBBB->ShouldIgnoreForHoist(I);
+    SmallPtrSet<BasicBlock *, 8> Visited;
+    while (BB && Visited.insert(BB)) {
+        double Count = PI->getExecutionCount(BB);
+        if (Count != ProfileInfo::MissingValue) {
+            return Count;
+        }
+
+        // Only follow a unique predecessor, ignoring redo blocks which branch
+        // back into the .rest block they were split from.
+        BasicBlock *Prev = 0;
+        for (pred_iterator P = pred_begin(BB), E = pred_end(BB); P != E; ++P) {
+            if (RedoBBBuilder::IsRedoBB(*P) || *P == Prev) { continue; }
+            if (Prev) {
+                Prev = 0;
+                break;
+            }
+            Prev = *P;
+        }
+        BB = Prev;
+    }
+    return ProfileInfo::MissingValue;
+}
+
+/// canSinkModifiedLoad - A load whose memory is written in the loop can still
+/// be sunk to the exit blocks when nothing may write it between the load and
+/// leaving the loop.  sink() only moves it to exits its block dominates, so
+/// the load ran in the last iteration, and the reload at the exit sees the
+/// same address and the same memory.
+///
+bool SLICM::canSinkModifiedLoad(Instruction &I)
+{
+    LoadInst *LD = dyn_cast<LoadInst>(&I);
+    if (!LD || !LD->isUnordered() || RBBB->ShouldIgnoreForHoist(I)) {
+        return false;
+    }
+
+    uint64_t Size = 0;
+    if (LD->getType()->isSized()) {
+        Size = AA->getTypeStoreSize(LD->getType());
+    }
+    AliasAnalysis::Location Loc(LD->getOperand(0), Size,
+                                LD->getMetadata(LLVMContext::MD_tbaa));
+
+    // Walk the rest of the iteration: everything after the load in its block,
+    // then every loop block reachable without taking a backedge to the header.
+    BasicBlock *Header = CurLoop->getHeader();
+    SmallPtrSet<BasicBlock *, 16> Visited;
+    SmallVector<BasicBlock *, 16> Worklist;
+    BasicBlock::iterator It = LD;
+    BasicBlock *BB = LD->getParent();
+    for (++It;;) {
+        for (BasicBlock::iterator E = BB->end(); It != E; ++It) {
+            if (It->mayWriteToMemory()
+                && (AA->getModRefInfo(&*It, Loc) & AliasAnalysis::Mod)) {
+                DEBUG(dbgs() << "SLICM can not sink (" << I << "  ), clobbered by ("
+                             << *It << "  )\n");
+                return false;
+            }
+        }
+        for (succ_iterator SuccI = succ_begin(BB), SuccE = succ_end(BB);
+             SuccI != SuccE; ++SuccI) {
+            BasicBlock *Succ = *SuccI;
+            if (Succ != Header && CurLoop->contains(Succ) && Visited.insert(Succ)) {
+                Worklist.push_back(Succ);
+            }
+        }
+        if (Worklist.empty()) { break; }
+        BB = Worklist.pop_back_val();
+        It = BB->begin();
+    }
+
+    return true;
 }
 
 /// isNotUsedInLoop - Return true if the only users of this instruction are
@@ -513,7 +860,7 @@ bool SLICM::isNotUsedInLoop(Instruction &I)
 /// This method is guaranteed to remove the original instruction from its
 /// position, and may either delete it or move it to outside of the loop.
 ///
-void SLICM::sink(Instruction &I)
+void SLICM::sink(Instruction &I, bool ModifiedLoad)
 {
     DEBUG(dbgs() << "SLICM sinking instruction: " << I << "\n");
 
@@ -522,6 +869,7 @@ void SLICM::sink(Instruction &I)
 
     if (isa<LoadInst>(I)) { ++NumMovedLoads; }
     else if (isa<CallInst>(I)) { ++NumMovedCalls; }
+    if (ModifiedLoad) { ++NumSunkModLoads; }
     ++NumSunk;
     Changed = true;
 
@@ -657,20 +1005,6 @@ void SLICM::hoist(Instruction &I)
     Changed = true;
 }
 
-BasicBlock *SLICM::getOrCreatePrePreheader()
-{
-    if (PrePreheader) return PrePreheader;
-    if (!Preheader) return 0;
-
-    PrePreheader = Preheader;
-    Instruction *first = &(Preheader->getInstList().front());
-    Preheader = SplitBlock(Preheader, first, this);
-    std::string name = PrePreheader->getName();
-    PrePreheader->setName(name + ".prepre");
-    Preheader->setName(name);
-    return PrePreheader;
-}
-
 BasicBlock* SLICM::getOrCreatePostPreheader()
 {
     if (PostPreheader) return PostPreheader;
@@ -689,15 +1023,13 @@ void SLICM::speculativeHoist(Instruction &I)
     DEBUG(dbgs() << "    SLICM begin speculative hoisting (" << I
                 << "  ) to preheader: " << Preheader->getName() << "\n");
 
-    LoadInst *LD = cast<LoadInst>(&I);
-
-    // Add `LD` to itself dependency list
-    SmallVector<LoadInst *, 2> vec;
-    vec.push_back(LD);
-    SpeculateHoisted[LD] = vec;
+    // Add `I` to itself dependency list
+    SmallVector<Instruction *, 2> vec;
+    vec.push_back(&I);
+    SpeculateHoisted[&I] = vec;
 
     // Create redoBB
-    RBBB->CreateRedoBB(*LD);
+    RBBB->CreateRedoBB(I);
 
     // hoist I to preheader
     hoist(I);
@@ -759,6 +1091,7 @@ bool SLICM::isGuaranteedToExecute(Instruction &Inst)
 namespace {
 class LoopPromoter : public LoadAndStorePromoter
 {
+protected:
     Value *SomePtr;  // Designated pointer to store to.
     SmallPtrSet<Value *, 4> &PointerMustAliases;
     SmallVectorImpl<BasicBlock *> &LoopExitBlocks;
@@ -818,6 +1151,43 @@ public:
         AST.deleteValue(I);
     }
 };
+
+/// Promotes a location that other accesses in the loop may alias.  Those
+/// accesses are guarded by spill blocks, which write the register back to
+/// memory, and the reloads after them are fed to the SSAUpdater up front.
+class SpeculativeLoopPromoter : public LoopPromoter
+{
+    SmallVectorImpl<BasicBlock *> &SpillBlocks;
+public:
+    SpeculativeLoopPromoter(Value *SP,
+                            const SmallVectorImpl<Instruction *> &Insts, SSAUpdater &S,
+                            SmallPtrSet<Value *, 4> &PMA,
+                            SmallVectorImpl<BasicBlock *> &LEB,
+                            SmallVectorImpl<Instruction *> &LIP,
+                            SmallVectorImpl<BasicBlock *> &SB,
+                            AliasSetTracker &ast, DebugLoc dl, int alignment,
+                            MDNode *TBAATag)
+        : LoopPromoter(SP, Insts, S, PMA, LEB, LIP, ast, dl, alignment, TBAATag),
+          SpillBlocks(SB) {}
+
+    virtual void doExtraRewritesBeforeFinalDeletion() const
+    {
+        LoopPromoter::doExtraRewritesBeforeFinalDeletion();
+
+        // Write the current value back in front of each guarded access that
+        // overlaps the promoted location.
+        for (unsigned i = 0, e = SpillBlocks.size(); i != e; ++i) {
+            BasicBlock *SpillBlock = SpillBlocks[i];
+            Value *LiveInValue = SSA.GetValueInMiddleOfBlock(SpillBlock);
+            StoreInst *NewSI = new StoreInst(LiveInValue, SomePtr,
+                                             SpillBlock->getTerminator());
+            NewSI->setAlignment(Alignment);
+            NewSI->setDebugLoc(DL);
+            if (TBAATag) { NewSI->setMetadata(LLVMContext::MD_tbaa, TBAATag); }
+            AST.add(NewSI);
+        }
+    }
+};
 } // end anon namespace
 
 /// PromoteAliasSet - Try to promote memory values to scalars by sinking
@@ -829,6 +1199,12 @@ void SLICM::PromoteAliasSet(AliasSet &AS,
                             SmallVectorImpl<BasicBlock *> &ExitBlocks,
                             SmallVectorImpl<Instruction *> &InsertPts)
 {
+    if (SpeculativePromotion && !AS.isForwardingAliasSet() && AS.isMod()
+        && !AS.isMustAlias() && !AS.isVolatile()) {
+        SpeculativePromoteAliasSet(AS, ExitBlocks, InsertPts);
+        return;
+    }
+
     // We can promote this alias set if it has a store, if it is a "Must" alias
     // set, if the pointer is loop invariant, and if we are not eliminating any
     // volatile loads or stores.
@@ -993,6 +1369,218 @@ void SLICM::PromoteAliasSet(AliasSet &AS,
 }
 
 
+/// SpeculativePromoteAliasSet - Promote a loop invariant location of a may
+/// alias set to a register anyway.  Every other load and store of the set is
+/// guarded with an address range check: if it overlaps the location, the
+/// register is written back before the access, and reloaded after it when it
+/// is a store.
+///
+void SLICM::SpeculativePromoteAliasSet(AliasSet &AS,
+                                       SmallVectorImpl<BasicBlock *> &ExitBlocks,
+                                       SmallVectorImpl<Instruction *> &InsertPts)
+{
+    // The first loop invariant pointer of the set is promoted.
+    Value *SomePtr = 0;
+    for (AliasSet::iterator ASI = AS.begin(), E = AS.end(); ASI != E; ++ASI) {
+        if (CurLoop->isLoopInvariant(ASI->getValue())) {
+            SomePtr = ASI->getValue();
+            break;
+        }
+    }
+    if (!SomePtr) { return; }
+
+    Type *Ty = cast<PointerType>(SomePtr->getType())->getElementType();
+    if (!Ty->isSized()) { return; }
+    uint64_t Size = AA->getTypeStoreSize(Ty);
+
+    // As in PromoteAliasSet, the promoted accesses must all be simple loads
+    // and stores, with a store guaranteed to execute.  Accesses through the
+    // other pointers of the set are guarded instead.
+    bool GuaranteedToExecute = false;
+    SmallVector<Instruction *, 64> LoopUses;
+    SmallVector<Instruction *, 16> Guarded;
+    SmallPtrSet<Value *, 4> PointerMustAliases;
+    unsigned Alignment = 1;
+    MDNode *TBAATag = 0;
+
+    for (AliasSet::iterator ASI = AS.begin(), E = AS.end(); ASI != E; ++ASI) {
+        Value *ASIV = ASI->getValue();
+        bool Must = ASIV->getType() == SomePtr->getType()
+                    && AA->alias(ASIV, Size, SomePtr, Size) == AliasAnalysis::MustAlias;
+        if (Must) {
+            PointerMustAliases.insert(ASIV);
+        }
+
+        for (Value::use_iterator UI = ASIV->use_begin(), UE = ASIV->use_end();
+             UI != UE; ++UI) {
+            Instruction *Use = dyn_cast<Instruction>(*UI);
+            if (!Use || !CurLoop->contains(Use)) {
+                continue;
+            }
+
+            if (LoadInst *load = dyn_cast<LoadInst>(Use)) {
+                if (!load->isSimple()) {
+                    return;
+                }
+            } else if (StoreInst *store = dyn_cast<StoreInst>(Use)) {
+                if (Use->getOperand(1) != ASIV) {
+                    continue;
+                }
+                if (!store->isSimple()) {
+                    return;
+                }
+
+                if (Must) {
+                    unsigned InstAlignment = store->getAlignment();
+                    if ((InstAlignment > Alignment || InstAlignment == 0) && Alignment != 0)
+                        if (isGuaranteedToExecute(*Use)) {
+                            GuaranteedToExecute = true;
+                            Alignment = InstAlignment;
+                        }
+
+                    if (!GuaranteedToExecute) {
+                        GuaranteedToExecute = isGuaranteedToExecute(*Use);
+                    }
+                }
+            } else if (Must) {
+                return;    // The promoted pointer escapes.
+            } else {
+                continue;  // Not an access, calls are checked below.
+            }
+
+            if (!Must) {
+                Guarded.push_back(Use);
+                continue;
+            }
+
+            if (LoopUses.empty()) {
+                TBAATag = Use->getMetadata(LLVMContext::MD_tbaa);
+            } else if (TBAATag) {
+                TBAATag = MDNode::getMostGenericTBAA(TBAATag,
+                                                     Use->getMetadata(LLVMContext::MD_tbaa));
+            }
+
+            LoopUses.push_back(Use);
+        }
+    }
+
+    if (!GuaranteedToExecute) {
+        return;
+    }
+
+    // Anything but a load or store touching the location can't be guarded.
+    AliasAnalysis::Location Loc(SomePtr, Size);
+    for (Loop::block_iterator BI = CurLoop->block_begin(), BE = CurLoop->block_end();
+         BI != BE; ++BI) {
+        for (BasicBlock::iterator I = (*BI)->begin(), E = (*BI)->end(); I != E; ++I) {
+            if (isa<LoadInst>(I) || isa<StoreInst>(I) || !I->mayReadOrWriteMemory()) {
+                continue;
+            }
+            if (AA->getModRefInfo(&*I, Loc) != AliasAnalysis::NoModRef) {
+                return;
+            }
+        }
+    }
+
+    DEBUG(dbgs() << "SLICM: Speculatively promoting value stored to in loop: "
+                 << *SomePtr << ", guarding " << Guarded.size() << " accesses\n");
+    Changed = true;
+    ++NumSpecPromoted;
+
+    DebugLoc DL = LoopUses[0]->getDebugLoc();
+
+    if (ExitBlocks.empty()) {
+        CurLoop->getUniqueExitBlocks(ExitBlocks);
+        InsertPts.resize(ExitBlocks.size());
+        for (unsigned i = 0, e = ExitBlocks.size(); i != e; ++i) {
+            InsertPts[i] = ExitBlocks[i]->getFirstInsertionPt();
+        }
+    }
+
+    // Guard each access:
+    //
+    //   %chk = <access overlaps SomePtr>
+    //   br %chk, %spill, %body
+    // spill:                       ; store of the register, added by the promoter
+    //   br %body
+    // body:
+    //   <the access>
+    //   br %chk, %reload, %rest    ; stores only
+    // reload:
+    //   %reload = load SomePtr
+    //   br %rest
+    SmallVector<BasicBlock *, 8> SpillBlocks;
+    SmallVector<LoadInst *, 8> ReloadLoads;
+    for (unsigned i = 0, e = Guarded.size(); i != e; ++i) {
+        Instruction *Access = Guarded[i];
+        Value *Ptr;
+        Type *AccessTy;
+        if (LoadInst *LD = dyn_cast<LoadInst>(Access)) {
+            Ptr = LD->getPointerOperand();
+            AccessTy = LD->getType();
+        } else {
+            StoreInst *SI = cast<StoreInst>(Access);
+            Ptr = SI->getPointerOperand();
+            AccessTy = SI->getValueOperand()->getType();
+        }
+
+        Instruction *Chk = RBBB->CreateOverlapCheck(Ptr, AA->getTypeStoreSize(AccessTy),
+                                                    SomePtr, Size, Access);
+
+        BasicBlock *Head = Access->getParent();
+        BasicBlock *Body = SplitBlock(Head, Access, this);
+        BasicBlock *Spill = SplitBlock(Head, Head->getTerminator(), this);
+        Spill->setName(Head->getName() + ".spill");
+        Head->getTerminator()->eraseFromParent();
+        BranchInst::Create(Spill, Body, Chk, Head);
+        DT->changeImmediateDominator(Body, Head);
+        SpillBlocks.push_back(Spill);
+
+        if (isa<StoreInst>(Access)) {
+            BasicBlock *Rest = SplitBlock(Body, Access->getNextNode(), this);
+            BasicBlock *Reload = SplitBlock(Body, Body->getTerminator(), this);
+            Reload->setName(Head->getName() + ".reload");
+            Body->getTerminator()->eraseFromParent();
+            BranchInst::Create(Reload, Rest, Chk, Body);
+            DT->changeImmediateDominator(Rest, Body);
+
+            LoadInst *ReloadLoad = new LoadInst(SomePtr, SomePtr->getName() + ".reload",
+                                                Reload->getTerminator());
+            ReloadLoad->setAlignment(Alignment);
+            ReloadLoad->setDebugLoc(DL);
+            if (TBAATag) { ReloadLoad->setMetadata(LLVMContext::MD_tbaa, TBAATag); }
+            CurAST->add(ReloadLoad);
+            ReloadLoads.push_back(ReloadLoad);
+        }
+        ++NumPromoteGuards;
+    }
+
+    SmallVector<PHINode *, 16> NewPHIs;
+    SSAUpdater SSA(&NewPHIs);
+    SpeculativeLoopPromoter Promoter(SomePtr, LoopUses, SSA, PointerMustAliases,
+                                     ExitBlocks, InsertPts, SpillBlocks, *CurAST,
+                                     DL, Alignment, TBAATag);
+
+    LoadInst *PreheaderLoad =
+        new LoadInst(SomePtr, SomePtr->getName() + ".promoted",
+                     Preheader->getTerminator());
+    PreheaderLoad->setAlignment(Alignment);
+    PreheaderLoad->setDebugLoc(DL);
+    if (TBAATag) { PreheaderLoad->setMetadata(LLVMContext::MD_tbaa, TBAATag); }
+    SSA.AddAvailableValue(Preheader, PreheaderLoad);
+
+    // The reloads are the only definitions in their blocks.
+    for (unsigned i = 0, e = ReloadLoads.size(); i != e; ++i) {
+        SSA.AddAvailableValue(ReloadLoads[i]->getParent(), ReloadLoads[i]);
+    }
+
+    Promoter.run(LoopUses);
+
+    if (PreheaderLoad->use_empty()) {
+        PreheaderLoad->eraseFromParent();
+    }
+}
+
 /// cloneBasicBlockAnalysis - Simple Analysis hook. Clone alias set info.
 void SLICM::cloneBasicBlockAnalysis(BasicBlock *From, BasicBlock *To, Loop *L)
 {
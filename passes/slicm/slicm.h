@@ -7,9 +7,13 @@
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/AliasSetTracker.h"
 #include "llvm/Analysis/ProfileInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Target/TargetLibraryInfo.h"
+#include <map>
+#include <set>
+#include "LAMP/LAMPLoadProfile.h"
 
 using namespace llvm;
 
@@ -39,8 +43,9 @@ struct SLICM : public LoopPass
         // AU.addPreserved("scalar-evolution");    // 583 - commented out
         // AU.addPreservedID(LoopSimplifyID);      // 583 - commented out
         AU.addRequired<TargetLibraryInfo>();
+        AU.addRequired<ScalarEvolution>();
         AU.addRequired<ProfileInfo>();
-        //AU.addRequired<LAMPLoadProfile>();
+        AU.addRequired<LAMPLoadProfile>();
     }
 
     using llvm::Pass::doFinalization;
@@ -58,19 +63,21 @@ private:
 
     DataLayout *TD;          // DataLayout for constant folding.
     TargetLibraryInfo *TLI;  // TargetLibraryInfo for constant folding.
+    ProfileInfo *PI;         // Edge profile, for block execution counts.
+    LAMPLoadProfile *LAMP;   // Memory dependence profile from LAMP.
+    ScalarEvolution *SE;     // Store address ranges, for loop versioning.
 
     // State that is updated as we process loops.
     bool Changed;            // Set to true when we change anything.
     BasicBlock *Preheader;   // The preheader block of the current loop...
     BasicBlock *PostPreheader;  // The block after preheader...
-    BasicBlock *PrePreheader; // The block before preheader...
     Loop *CurLoop;           // The current loop we are working on...
     AliasSetTracker *CurAST; // AliasSet information for the current loop...
     bool MayThrow;           // The current loop contains an instruction which
                              // may throw, thus preventing code motion of
                              // instructions with side effects.
     DenseMap<Loop *, AliasSetTracker *> LoopToAliasSetMap;
-    DenseMap<Instruction *, SmallVector<LoadInst*, 2>> SpeculateHoisted;
+    DenseMap<Instruction *, SmallVector<Instruction*, 2>> SpeculateHoisted;
 
     // Helper class for speculative hoist
     RedoBBBuilder *RBBB;
@@ -111,9 +118,10 @@ private:
 
     /// sink - When an instruction is found to only be used outside of the loop,
     /// this function moves it to the exit blocks and patches up SSA form as
-    /// needed.
+    /// needed.  `ModifiedLoad` is set for a load that canSinkModifiedLoad
+    /// allowed.
     ///
-    void sink(Instruction &I);
+    void sink(Instruction &I, bool ModifiedLoad = false);
 
     /// hoist - When an instruction is found to only use loop invariant operands
     /// that is safe to hoist, this instruction is called to do the dirty work.
@@ -149,19 +157,48 @@ private:
     AliasSet &getAliasSetForLoadSrc(LoadInst* LI);
 
     BasicBlock *getOrCreatePostPreheader();
-    BasicBlock *getOrCreatePrePreheader();
     bool canSinkOrHoistInst(Instruction& I, bool* speculative = 0);
     bool isHoistableInstr(Instruction &I);
-    bool canSpeculativeHoist(LoadInst& I);
+    bool canSpeculativeHoist(Instruction& I);
+
+    /// hasUncheckedWriter - Return true if an instruction in the loop that
+    /// RedoBBBuilder does not check may write memory read by `I`.
+    ///
+    bool hasUncheckedWriter(Instruction &I);
+
+    /// isProfitableSpeculativeHoist - Weigh the instructions saved by hoisting
+    /// `Spec` against the checks and redo work it adds, using profiled block
+    /// counts.  Accepts when no profile is available.
+    ///
+    bool isProfitableSpeculativeHoist(Instruction &Spec);
+
+    /// getHoistChain - Return the number of instructions that would leave the
+    /// loop together with `Spec`, and in `Reloads` the number of in-loop users
+    /// of them left behind, each of which reloads a stack value.
+    ///
+    unsigned getHoistChain(Instruction &Spec, unsigned &Reloads);
+
+    /// getConflictRate - Return the fraction of executions of `I` that read a
+    /// value written by a store from within the current loop, as measured by
+    /// the LAMP dependence profile.
+    ///
+    double getConflictRate(Instruction &I);
+    double getProfiledConflicts(Instruction &I, BasicBlock *Header);
+    double getParsedConflicts(Instruction &I, BasicBlock *Header);
+
+    /// getExecutionCount - Return the profiled execution count of `BB`, or
+    /// ProfileInfo::MissingValue if it is unknown.
+    ///
+    double getExecutionCount(BasicBlock *BB);
+    /// canSinkModifiedLoad - Return true if `I` is a load from memory written
+    /// in the loop, but not after `I` within an iteration, so it can be
+    /// reloaded at the exit blocks.
+    ///
+    bool canSinkModifiedLoad(Instruction &I);
     bool isNotUsedInLoop(Instruction &I);
     bool hasLoopInvariantOperands(Instruction &I);
     void maybeResultOfSpeculativeHoist(Instruction &I);
 
-    bool isPrePre(BasicBlock *BB)
-    {
-        return BB->getName().endswith(".prepre");
-    }
-
     bool isPostPre(BasicBlock *BB)
     {
         return BB->getName().endswith(".postpre");
@@ -170,6 +207,13 @@ private:
     void PromoteAliasSet(AliasSet &AS,
                          SmallVectorImpl<BasicBlock *> &ExitBlocks,
                          SmallVectorImpl<Instruction *> &InsertPts);
+
+    /// SpeculativePromoteAliasSet - Promote a location of a may alias set,
+    /// guarding the other accesses of the set with range checks.
+    ///
+    void SpeculativePromoteAliasSet(AliasSet &AS,
+                                    SmallVectorImpl<BasicBlock *> &ExitBlocks,
+                                    SmallVectorImpl<Instruction *> &InsertPts);
     friend class RedoBBBuilder;
 };
 }
@@ -4,9 +4,19 @@ mkdir -p $2
 
 ./$1 > $2/orig
 ./$1.slicm > $2/res
-if diff -q $2/{orig,res}; then
+if diff -q $2/orig $2/res; then
     printf "[PASSED]"
 else
     printf "[FAILED]"
 fi
 echo " $1"
+
+if [ -x ./$1.intelligent-slicm ]; then
+    ./$1.intelligent-slicm > $2/res.intelligent
+    if diff -q $2/orig $2/res.intelligent; then
+        printf "[PASSED]"
+    else
+        printf "[FAILED]"
+    fi
+    echo " $1 (intelligent)"
+fi
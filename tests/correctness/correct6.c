@@ -0,0 +1,28 @@
+// test 6:  has conflicts, the store to the hoisted load's memory is made by a callee.
+#include "stdio.h"
+
+int a[100];
+int c[100];
+int limit = 50;
+
+void bump(int i)
+{
+    if (i % 10 == 9)
+        limit = limit + i;
+}
+
+int main()
+{
+    int i;
+
+    for (i=0;i<100;i++){
+        a[i] = i;
+    }
+
+    for (i=0;i<100;i++){
+        bump(i);
+        c[i] = limit*2 + a[i];
+    }
+    printf ("%d, %d, %d\n",c[9],c[50],c[99]);
+    return 0;
+}
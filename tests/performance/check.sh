@@ -7,12 +7,29 @@ shift
 
 mkdir -p $OUT
 
-./$NAME "$@" > $OUT/orig
-./$NAME.slicm "$@" > $OUT/res
+# Run one build of the program, keeping its output without the timing lines
+# so that builds can be compared, and report the time it took.
+run() {
+    BIN=$1
+    shift
+    ./$BIN "$@" > $OUT/$BIN.full
+    grep -v "time spent" $OUT/$BIN.full > $OUT/$BIN.out
+    TIME=`sed -n 's/.*time spent = \([0-9.]*\).*/\1/p' $OUT/$BIN.full | head -n 1`
+}
 
-if diff -q $OUT/{orig,res}; then
-    printf "[PASSED]"
-else
-    printf "[FAILED]"
-fi
-echo " $NAME"
+run $NAME "$@"
+echo "         $NAME: ${TIME:-?}s"
+
+for MODE in slicm slicm-range slicm-version intelligent-slicm; do
+    if [ ! -x ./$NAME.$MODE ]; then
+        continue
+    fi
+
+    run $NAME.$MODE "$@"
+    if diff -q $OUT/$NAME.out $OUT/$NAME.$MODE.out > /dev/null; then
+        printf "[PASSED]"
+    else
+        printf "[FAILED]"
+    fi
+    echo " $NAME.$MODE: ${TIME:-?}s"
+done
@@ -0,0 +1,68 @@
+//===- lamp_dump.cpp - Print a binary LAMP profile as text ----------------===//
+//
+// Usage: lamp-dump [profile]
+//
+// Prints a binary profile (result.lamp.profile by default) on stdout in the
+// text format the runtime writes with LAMP_PROFILE_TEXT, so that the output
+// can also be fed back to LAMPLoadProfile.
+//
+//===----------------------------------------------------------------------===//
+
+#include "LAMP/LAMPProfileFormat.h"
+
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+#include <inttypes.h>
+
+// The order the runtime prints dependences in
+static bool text_order(const lamp_profile_record_t *r1, const lamp_profile_record_t *r2)
+{
+  if (r1->load != r2->load)
+    return r1->load < r2->load;
+  if (r1->dist != r2->dist)
+    return r1->dist < r2->dist;
+  if (r1->store != r2->store)
+    return r1->store < r2->store;
+  return r1->loop < r2->loop;
+}
+
+int main (int argc, char ** argv)
+{
+  const char *file = (argc > 1) ? argv[1] : "result.lamp.profile";
+
+  uint64_t size;
+  const lamp_profile_header_t *header = lamp_profile_map(file, &size);
+  if (header == NULL) {
+    fprintf(stderr, "%s is not a binary LAMP profile (version %d)\n", file, LAMP_PROFILE_VERSION);
+    exit(1);
+  }
+
+  const lamp_profile_record_t *records = lamp_profile_records(header);
+  std::vector<const lamp_profile_record_t *> sorted(header->num_records);
+  for (uint64_t i = 0; i < header->num_records; i++)
+    sorted[i] = &records[i];
+  std::sort(sorted.begin(), sorted.end(), text_order);
+
+  if (header->sample_period != 0)
+    printf("SAMPLING %" PRIu32 " %" PRIu32 "\n", header->sample_period, header->sample_burst);
+
+  printf("BEGIN Memory Profile\n");
+  for (uint64_t i = 0; i < sorted.size(); i++) {
+    const lamp_profile_record_t *r = sorted[i];
+    printf("(%" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 " (%" PRIu64 " %" PRIu64 " ) )\n",
+           r->load, r->dist, r->loop, r->store, r->total_count, r->loop_count);
+  }
+  printf("END Memory Profile\n");
+
+  printf("run_time: %.3g\n", header->run_time_usec / 1000000.0);
+  printf("Num threads: %" PRIu32 "\n", header->num_threads);
+  printf("Num dynamic stores: %" PRIu64 "\n", header->dyn_stores);
+  printf("Num dynamic loads: %" PRIu64 "\n", header->dyn_loads);
+  printf("Max loop nest depth: %" PRIu32 "\n", header->max_depth);
+
+  lamp_profile_unmap(header, size);
+  exit(0);
+}
@@ -0,0 +1,32 @@
+// Access hooks for LAMPProfiler -lamp-fast-path. This file is only built
+// as bitcode (lamp_fast_path.bc), which is linked into the instrumented
+// program and inlined at each access site, so that an access hitting its
+// cached page costs no call. Everything else falls through to the
+// runtime's hooks in liblamphooks.
+
+#include "../lamp-profiler/lamp_hooks.hxx"
+#include "../lamp-profiler/lamp_fast_path.hxx"
+
+#define FAST_LOAD(name, type, slow)					\
+    __attribute__((always_inline))					\
+    void name(const uint32_t instr, const uint64_t addr) {		\
+	if (!LAMP_fast_load<type>(instr, addr))				\
+	    slow(instr, addr);						\
+    }
+
+#define FAST_STORE(name, type, slow)					\
+    __attribute__((always_inline))					\
+    void name(const uint32_t instr, const uint64_t addr, const uint64_t value) { \
+	if (!LAMP_fast_store<type>(instr, addr))			\
+	    slow(instr, addr, value);					\
+    }
+
+FAST_LOAD(LAMP_fast_load1, uint8_t, LAMP_load1)
+FAST_LOAD(LAMP_fast_load2, uint16_t, LAMP_load2)
+FAST_LOAD(LAMP_fast_load4, uint32_t, LAMP_load4)
+FAST_LOAD(LAMP_fast_load8, uint64_t, LAMP_load8)
+
+FAST_STORE(LAMP_fast_store1, uint8_t, LAMP_store1)
+FAST_STORE(LAMP_fast_store2, uint16_t, LAMP_store2)
+FAST_STORE(LAMP_fast_store4, uint32_t, LAMP_store4)
+FAST_STORE(LAMP_fast_store8, uint64_t, LAMP_store8)
@@ -0,0 +1,118 @@
+//===- lamp_merge.cpp - Sum several binary LAMP profiles ------------------===//
+//
+// Usage: lamp-merge -o <output> <profile>...
+//
+// Adds up the counts of every dependence over the given profiles, e.g. the
+// per-process profiles of runs on different inputs written with
+// LAMP_PROFILE_FILE=prof.%p, and writes the sum as one binary profile.
+// Profiles sampled with different parameters are first scaled up to whole
+// runs, and the result is then written as unsampled.
+//
+//===----------------------------------------------------------------------===//
+
+#include "LAMP/LAMPProfileFormat.h"
+
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static bool record_less(const lamp_profile_record_t &r1, const lamp_profile_record_t &r2)
+{
+  return lamp_profile_record_compare(&r1, &r2) < 0;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s -o <output> <profile>...\n", name);
+  exit(1);
+}
+
+int main (int argc, char ** argv)
+{
+  const char *output = NULL;
+  std::vector<const char *> inputs;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      output = argv[++i];
+    else
+      inputs.push_back(argv[i]);
+  }
+  if (output == NULL || inputs.empty())
+    usage(argv[0]);
+
+  std::vector<const lamp_profile_header_t *> headers(inputs.size());
+  std::vector<uint64_t> sizes(inputs.size());
+  uint64_t num_records = 0;
+  for (unsigned i = 0; i < inputs.size(); i++) {
+    headers[i] = lamp_profile_map(inputs[i], &sizes[i]);
+    if (headers[i] == NULL) {
+      fprintf(stderr, "%s is not a binary LAMP profile (version %d)\n", inputs[i], LAMP_PROFILE_VERSION);
+      exit(1);
+    }
+    num_records += headers[i]->num_records;
+  }
+
+  // Counts can only be added as they are if every run sampled alike
+  bool same_sampling = true;
+  for (unsigned i = 1; i < headers.size(); i++) {
+    same_sampling = same_sampling && (headers[i]->sample_period == headers[0]->sample_period)
+      && (headers[i]->sample_burst == headers[0]->sample_burst);
+  }
+
+  lamp_profile_header_t header;
+  memset(&header, 0, sizeof(header));
+  if (same_sampling) {
+    header.sample_period = headers[0]->sample_period;
+    header.sample_burst = headers[0]->sample_burst;
+  }
+
+  std::vector<lamp_profile_record_t> records;
+  records.reserve(num_records);
+  for (unsigned i = 0; i < headers.size(); i++) {
+    const lamp_profile_header_t *in = headers[i];
+    double scale = 1.0;
+    if (!same_sampling && in->sample_period != 0 && in->sample_burst != 0)
+      scale = (double) in->sample_period / in->sample_burst;
+
+    const lamp_profile_record_t *in_records = lamp_profile_records(in);
+    for (uint64_t r = 0; r < in->num_records; r++) {
+      lamp_profile_record_t record = in_records[r];
+      record.total_count = (uint64_t) (record.total_count * scale + 0.5);
+      record.loop_count = (uint64_t) (record.loop_count * scale + 0.5);
+      records.push_back(record);
+    }
+
+    header.num_threads += in->num_threads;
+    header.max_depth = std::max(header.max_depth, in->max_depth);
+    header.dyn_stores += in->dyn_stores;
+    header.dyn_loads += in->dyn_loads;
+    header.run_time_usec += in->run_time_usec;
+  }
+
+  // Sum the counts of equal dependences, which sorting makes adjacent
+  std::sort(records.begin(), records.end(), record_less);
+  uint64_t merged = 0;
+  for (uint64_t r = 0; r < records.size(); r++) {
+    if (merged != 0 && lamp_profile_record_compare(&records[merged - 1], &records[r]) == 0) {
+      records[merged - 1].total_count += records[r].total_count;
+      records[merged - 1].loop_count += records[r].loop_count;
+    } else {
+      records[merged++] = records[r];
+    }
+  }
+  records.resize(merged);
+
+  FILE *file = fopen(output, "wb");
+  if (file == NULL
+      || lamp_profile_write(file, &header, records.empty() ? NULL : &records[0], records.size()) != 0
+      || fclose(file) != 0) {
+    fprintf(stderr, "Unable to write %s\n", output);
+    exit(1);
+  }
+
+  for (unsigned i = 0; i < headers.size(); i++)
+    lamp_profile_unmap(headers[i], sizes[i]);
+  exit(0);
+}
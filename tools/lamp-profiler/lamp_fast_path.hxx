@@ -0,0 +1,110 @@
+#ifndef LAMP_FAST_PATH_H
+#define LAMP_FAST_PATH_H
+
+#include "../utils/MemoryMap.hxx"
+
+// Time stamps are per thread; a stamp also records the thread that made
+// it so that loads can tell cross-thread dependences apart.
+typedef struct timestamp_s {
+    uint32_t instr:20;
+    uint32_t thread:8;
+    uint64_t timestamp:36;
+} __attribute__((__packed__)) timestamp_t;
+
+inline bool operator==(const timestamp_t &t1, const timestamp_t &t2) {
+    return *((uint64_t *) &t1) == *((uint64_t *) &t2);
+}
+
+static const uint64_t TIME_STAMP_MAX = ((1ULL << 36) - 1);
+static const uint64_t INSTR_MAX = ((1ULL << 20) - 1);
+static const uint64_t THREAD_MAX = ((1ULL << 8) - 1);
+
+typedef Memory::MemoryStampMap<timestamp_t> MemoryStamp;
+
+typedef MemoryStamp::PageType StampPageType;
+
+class Pages {    // for each instruction to track the recently accessed page
+private:         // if the accessed page is changed -> go to memory_stamp to get
+    StampPageType *stampPage;
+
+public:
+    Pages() : stampPage(NULL) {}
+
+    Pages(MemoryStamp &stampMemory)
+	: stampPage(stampMemory.get_or_create_node((void *) NULL)) {}
+
+    void setStampPage(StampPageType *page) {
+	if (page == NULL)
+	    abort();
+	this->stampPage = page;
+    }
+
+    StampPageType *getStampPage() {
+	return this->stampPage;
+    }
+};
+
+/**
+ * The part of a thread's state that the access hooks need when the
+ * access hits the page its instruction touched last. The runtime's own
+ * hooks try this path first, and lamp_fast_path.bc builds it into hooks
+ * that are inlined at every access site. Anything else, i.e. a page miss,
+ * an unaligned access or a load that depends on a store, goes through a
+ * real call into the runtime.
+ */
+struct FastPathState {
+    Pages *pages;            // NULL while every access has to be analyzed
+    uint32_t thread_id;
+    uint64_t time_stamp;
+    int64_t dyn_stores, dyn_loads;
+};
+
+// Set once the thread has its state
+extern __thread FastPathState *LAMP_fast_path;
+
+template <class T>
+static inline StampPageType *fast_path_page(FastPathState *fast, const uint32_t instr, const uint64_t addr) {
+    if ((fast == NULL) || (fast->pages == NULL) || !Memory::is_aligned<T>(addr))
+	return NULL;
+
+    StampPageType *page = fast->pages[instr].getStampPage();
+    return page->inPage((void *) addr) ? page : NULL;
+}
+
+/// Handle a load that no tracked store reaches; false if the runtime
+/// has to analyze it.
+template <class T>
+static inline bool LAMP_fast_load(const uint32_t instr, const uint64_t addr) {
+    FastPathState *fast = LAMP_fast_path;
+    StampPageType *page = fast_path_page<T>(fast, instr, addr);
+    if (page == NULL)
+	return false;
+
+    const timestamp_t *stores[sizeof(T)];
+    if (page->get_stamps((void *) addr, sizeof(T), stores) != 0)
+	return false;
+
+    fast->dyn_loads++;
+    return true;
+}
+
+/// Stamp a store into its instruction's cached page; false if the
+/// runtime has to handle it.
+template <class T>
+static inline bool LAMP_fast_store(const uint32_t instr, const uint64_t addr) {
+    FastPathState *fast = LAMP_fast_path;
+    StampPageType *page = fast_path_page<T>(fast, instr, addr);
+    if ((page == NULL) || (fast->time_stamp > TIME_STAMP_MAX))
+	return false;
+
+    timestamp_t ts;
+    ts.timestamp = fast->time_stamp;
+    ts.thread = fast->thread_id;
+    ts.instr = instr;
+    page->stamp((void *) addr, sizeof(T), ts);
+
+    fast->dyn_stores++;
+    return true;
+}
+
+#endif
@@ -1,9 +1,13 @@
 #define __STDC_FORMAT_MACROS
 
 #include "lamp_hooks.hxx"
+#include "lamp_fast_path.hxx"
 #include "../utils/MemoryMap.hxx"
 #include "../utils/LoopHierarchy.hxx"
 #include "../utils/MemoryProfile.hxx"
+#include "../utils/Locks.hxx"
+#include "../utils/TraceBuffer.hxx"
+#include "LAMP/LAMPProfileFormat.h"
 
 #define LOAD LAMP_external_load
 #define STORE LAMP_external_store
@@ -22,11 +26,16 @@
 #include <fstream>
 #include <map>
 #include <vector>
+#include <string>
+
+#include <sched.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace Memory;
 using namespace Loop;
 using namespace Profiling;
+using namespace Trace;
 
 using namespace __gnu_cxx;
 
@@ -39,70 +48,111 @@ uint64_t LAMP_param2;
 uint64_t LAMP_param3;
 uint64_t LAMP_param4;
 
-static uint32_t external_call_id;
-
-static uint64_t time_stamp;
-
-typedef struct timestamp_s {
-    uint32_t instr:20;
-    uint64_t timestamp:44;
-} __attribute__((__packed__)) timestamp_t;
-
-static const uint64_t TIME_STAMP_MAX = ((1ULL << 44) - 1);
-static const uint64_t INSTR_MAX = ((1ULL << 20) - 1);
-
-bool operator==(const timestamp_t &t1, const timestamp_t &t2) {
-    return *((uint64_t *) &t1) == *((uint64_t *) &t2);
-}
-
 static const uint64_t MAX_DEP_DIST = 2;
 
+// Iterations at the start of each sample window whose loads are not
+// recorded, so that the recorded ones can see loop-carried dependences
+static const uint64_t SAMPLE_WARMUP = MAX_DEP_DIST;
+
 typedef MemoryProfiler<MAX_DEP_DIST> MemoryProfilerType;
 
-static MemoryProfilerType *memoryProfiler;
+static MemoryStamp memory_stamp; // centralized map keeping track of addr -> StampPage<timestamp_t>
 
-typedef MemoryNodeMap<timestamp_t> MemoryStamp;
+// Each loop on the stack carries the epoch of its current iteration. A
+// dependence counts towards loop_count once per epoch.
+typedef uint64_t IterationEpoch;
 
-static MemoryStamp memory_stamp; // centralized map keeping track of addr -> MemoryPage<timestamp_t>
+typedef LoopHierarchy<IterationEpoch, Loop::DEFAULT_LOOP_DEPTH, MAX_DEP_DIST> Loops;
 
-typedef vector<DependenceSet> DependenceSets;
+typedef Loops::LoopInfoType LoopInfoType;
 
-typedef LoopHierarchy<DependenceSets, Loop::DEFAULT_LOOP_DEPTH, MAX_DEP_DIST> Loops;
+typedef vector<Pages> PageCache;   
 
-static Loops loop_hierarchy;
+// In trace mode the hooks only record what happened; the analysis replays
+// the records later, in batches.
+enum trace_kind_t {
+    TRACE_LOAD,
+    TRACE_STORE,
+    TRACE_ALLOCATE,
+    TRACE_DEALLOCATE,
+    TRACE_LOOP_INVOCATION,
+    TRACE_LOOP_ITERATION,
+    TRACE_LOOP_EXIT,
+    TRACE_LOAD_RANGE,       // byte accesses by an external call
+    TRACE_STORE_RANGE
+};
 
-typedef Loops::LoopInfoType LoopInfoType;
+typedef struct trace_record_s {
+    uint64_t addr;
+    uint32_t id;
+    uint32_t kind:4;
+    uint32_t size:28;
+} trace_record_t;
+
+typedef trace_record_t TraceRecord;
+
+static const uint64_t TRACE_SIZE_MAX = ((1ULL << 28) - 1);
+
+static const uint64_t DEFAULT_TRACE_RECORDS = (1ULL << 16);
+
+typedef TraceBuffer<TraceRecord> TraceBufferType;
+
+/**
+ * Everything the hooks update on every access, kept per thread so that the
+ * hooks take no locks. memory_stamp is the only state shared between
+ * threads; its pages are created lock-free and updated with atomic bitmap
+ * operations (see StampPage). LAMP_finish merges the profiles of all
+ * threads.
+ */
+struct ThreadState {
+    FastPathState fast;
+    uint32_t external_call_id;
+    uint64_t sample_clock;
+    IterationEpoch iteration_epoch;    // last epoch handed out
+    Loops loop_hierarchy;
+    PageCache pageCache;
+    MemoryProfilerType memoryProfiler;
+    TraceBufferType *trace;
+
+    ThreadState(uint32_t id, uint32_t num_instrs, uint64_t trace_records)
+	: external_call_id(0), sample_clock(1), iteration_epoch(1),
+	  loop_hierarchy(), pageCache(num_instrs, Pages(memory_stamp)), memoryProfiler(num_instrs),
+	  trace((trace_records != 0) ? new TraceBufferType(trace_records) : NULL) {
+	fast.pages = NULL;
+	fast.thread_id = id;
+	fast.time_stamp = 1;
+	fast.dyn_stores = 0;
+	fast.dyn_loads = 0;
+
+	// timestamp 0 is the special first "iteration" of the thread
+	loop_hierarchy.loopIteration(0);
+
+	loop_hierarchy.getCurrentLoop().setItem(iteration_epoch);
+    }
+};
 
-class Pages {    // for each instruction to track the recently accessed page
-private:         // if the accessed page is changed -> go to memory_stamp to get 
-    MemoryPage<timestamp_t> *stampPage;
+static __thread ThreadState *thread_state;
 
-public:
-    Pages() : stampPage(NULL) {}
+__thread FastPathState *LAMP_fast_path;
 
-    Pages(MemoryStamp &stampMemory) 
-	: stampPage(stampMemory.get_or_create_node((void *) NULL)) {}
+static vector<ThreadState *> thread_states;
 
-    void setStampPage(MemoryPage<timestamp_t> *page) {
-	if (page == NULL)
-	    abort();
-	this->stampPage = page;
-    }
+static Locks::Mutex thread_states_lock;
 
-    MemoryPage<timestamp_t> *getStampPage() {
-	return this->stampPage;
-    }
-};
+static pthread_t trace_consumer_thread;
 
-typedef vector<Pages> PageCache;   
+static pthread_key_t trace_flush_key;
 
-static PageCache pageCache;    
+static volatile bool trace_consumer_stop;
 
 
 /***** struct defs *****/
 typedef struct _lamp_params_t {
-    ofstream * lamp_out;
+    uint32_t num_instrs;
+    ofstream * lamp_out;     // text profile, NULL when writing binary
     ofstream * lamp_out2;
+    FILE * profile_out;      // binary profile
+    string profile_file;
     uint64_t mem_gran;
     uint64_t mem_gran_shift;
     uint64_t mem_gran_mask;
@@ -110,11 +160,17 @@ typedef struct _lamp_params_t {
     bool measure_iterations;
     bool profile_flow;
     bool profile_output;
+    uint64_t trace_records;
+    bool trace_thread;
+    uint64_t sample_period;
+    uint64_t sample_burst;
+    bool text_output;
+    bool fast_path;
 } lamp_params_t;
 
 typedef struct _lamp_stats_t {
     clock_t start_time;
-    int64_t dyn_stores, dyn_loads, num_sync_arcs;
+    int64_t num_sync_arcs;
     int64_t calls_to_qhash;
     uint32_t nest_depth;
 } lamp_stats_t;
@@ -123,6 +179,52 @@ typedef struct _lamp_stats_t {
 static lamp_params_t lamp_params;
 static lamp_stats_t lamp_stats;
 
+// The iterations recorded out of every sample_period, which counts are
+// scaled by when the profile is read
+static uint64_t sample_recorded(void) {
+    return lamp_params.sample_burst - SAMPLE_WARMUP;
+}
+
+/**
+ * The mode flags as compile time constants. The analysis is instantiated
+ * once per combination, so the per-access code does not test them;
+ * LAMP_init installs the instantiation for the requested mode in
+ * lamp_hooks.
+ */
+template <bool PROFILE_OUTPUT, bool SILENT_STORES, bool MEASURE_ITERATIONS>
+struct HookMode {
+    static const bool profile_flow = !PROFILE_OUTPUT;
+    static const bool profile_output = PROFILE_OUTPUT;
+    static const bool silent_stores = SILENT_STORES;
+    static const bool measure_iterations = MEASURE_ITERATIONS;
+};
+
+typedef void (*load_hook_t)(const uint32_t instr, const uint64_t addr);
+typedef void (*store_hook_t)(const uint32_t instr, const uint64_t addr, const uint64_t value);
+
+typedef struct _lamp_hooks_t {
+    load_hook_t load[4];     // indexed by log2 of the access size
+    store_hook_t store[4];
+    void (*load_range)(ThreadState &state, uint32_t instrId, uint64_t addr, uint64_t size);
+    void (*store_range)(ThreadState &state, uint32_t instrId, uint64_t addr, uint64_t size);
+    void (*deallocate)(ThreadState &state, uint32_t lampId, const void *memory, size_t size);
+    void (*loop_iteration)(ThreadState &state);
+    void (*loop_invocation)(ThreadState &state, const uint16_t loop);
+    uint64_t (*drain_trace)(ThreadState &state);
+} lamp_hooks_t;
+
+static void ignore_load(const uint32_t instr, const uint64_t addr) {}
+
+static void ignore_store(const uint32_t instr, const uint64_t addr, const uint64_t value) {}
+
+// Accesses before LAMP_init are ignored; the other entries are only used
+// once LAMP_initialized is set
+static lamp_hooks_t lamp_hooks = {
+    { ignore_load, ignore_load, ignore_load, ignore_load },
+    { ignore_store, ignore_store, ignore_store, ignore_store },
+    NULL, NULL, NULL, NULL, NULL
+};
+
 struct nullstream: std::ostream {
     struct nullbuf: std::streambuf {
 	int overflow(int c) { return traits_type::not_eof(c); }
@@ -134,25 +236,105 @@ static const bool debug_output = true;
 static nullstream null_stream;
 
 static ostream &debug() {
-    if (debug_output) {
+    if (debug_output && (lamp_params.lamp_out != NULL)) {
 	return *(lamp_params.lamp_out);
     } else {
 	return null_stream;
     }
 }
 
+static ThreadState &getThreadState() {
+    if (thread_state != NULL)
+	return *thread_state;
+
+    Locks::ScopedLock lock(thread_states_lock);
+    if (thread_states.size() > THREAD_MAX) {
+	cerr<<"Number of threads too high "<<thread_states.size()<<" > "<<THREAD_MAX<<endl;
+	abort();
+    }
+
+    thread_state = new ThreadState(thread_states.size(), lamp_params.num_instrs, lamp_params.trace_records);
+    thread_states.push_back(thread_state);
+
+    if (thread_state->trace != NULL)
+	pthread_setspecific(trace_flush_key, thread_state);
+
+    if (lamp_params.fast_path && !thread_state->pageCache.empty())
+	thread_state->fast.pages = &thread_state->pageCache[0];
+    LAMP_fast_path = &thread_state->fast;
+    return *thread_state;
+}
+
+static void sum_thread_stats(int64_t &dyn_stores, int64_t &dyn_loads, uint32_t &max_depth) {
+    dyn_stores = 0;
+    dyn_loads = 0;
+    max_depth = 0;
+    for (uint32_t i = 0; i < thread_states.size(); i++) {
+	dyn_stores += thread_states[i]->fast.dyn_stores;
+	dyn_loads += thread_states[i]->fast.dyn_loads;
+	max_depth = max(max_depth, thread_states[i]->loop_hierarchy.max_depth);
+    }
+}
+
 void LAMP_print_stats(ofstream &stream) {
+    int64_t dyn_stores, dyn_loads;
+    uint32_t max_depth;
+    sum_thread_stats(dyn_stores, dyn_loads, max_depth);
+
     stream<<setprecision(3);
     stream<<"run_time: "<<1.0*(clock()-lamp_stats.start_time)/CLOCKS_PER_SEC<<endl;
-    stream<<"Num dynamic stores: "<<lamp_stats.dyn_stores<<endl;
-    stream<<"Num dynamic loads: "<<lamp_stats.dyn_loads<<endl;
-    stream<<"Max loop nest depth: "<<loop_hierarchy.max_depth<<endl;
+    stream<<"Num threads: "<<thread_states.size()<<endl;
+    stream<<"Num dynamic stores: "<<dyn_stores<<endl;
+    stream<<"Num dynamic loads: "<<dyn_loads<<endl;
+    stream<<"Max loop nest depth: "<<max_depth<<endl;
 }
 
+static void *trace_consumer(void *arg);
+
+static uint64_t drain_trace(ThreadState &state) {
+    return lamp_hooks.drain_trace(state);
+}
+
+static void flush_trace(void *state);
+
+static void install_hooks(void);
+
+static void LAMP_write_profile(FILE *file, const MemoryProfilerType &memoryProfiler);
+
 /***** functions *****/
+static string profile_path(const char *env, const char *default_path) {
+    string path = (getenv(env) != NULL) ? getenv(env) : default_path;
+    for (size_t pos = path.find("%p"); pos != string::npos; pos = path.find("%p", pos)) {
+	char pid[32];
+	snprintf(pid, sizeof(pid), "%d", (int) getpid());
+	path.replace(pos, 2, pid);
+	pos += strlen(pid);
+    }
+    return path;
+}
+
 void LAMP_init(uint32_t num_instrs, uint32_t num_loops, uint64_t mem_gran, uint64_t flags) {
-    lamp_params.lamp_out = new ofstream("result.lamp.profile");
-    lamp_params.lamp_out2 = new ofstream("result.lamp.iter_cnt");
+    // LAMP_PROFILE_FILE and LAMP_PROFILE_ITER_CNT_FILE name the output
+    // files; "%p" in a name is replaced by the process id so that
+    // concurrent runs do not clobber each other
+    lamp_params.profile_file = profile_path("LAMP_PROFILE_FILE", "result.lamp.profile");
+
+    // LAMP_PROFILE_TEXT writes the profile in the old text format rather
+    // than the binary one from LAMPProfileFormat.h
+    lamp_params.text_output = (getenv("LAMP_PROFILE_TEXT") != NULL);
+    lamp_params.lamp_out = NULL;
+    lamp_params.profile_out = NULL;
+    if (lamp_params.text_output) {
+	lamp_params.lamp_out = new ofstream(lamp_params.profile_file.c_str());
+    } else {
+	lamp_params.profile_out = fopen(lamp_params.profile_file.c_str(), "wb");
+    }
+    if (((lamp_params.lamp_out != NULL) && !*(lamp_params.lamp_out))
+	|| (!lamp_params.text_output && (lamp_params.profile_out == NULL))) {
+	fprintf(stderr, "Unable to open %s\n", lamp_params.profile_file.c_str());
+	abort();
+    }
+    lamp_params.lamp_out2 = new ofstream(profile_path("LAMP_PROFILE_ITER_CNT_FILE", "result.lamp.iter_cnt").c_str());
     
 		if (sizeof(timestamp_t) != sizeof(uint64_t)) {
         fprintf(stderr, "sizeof(timestamp_t) != sizeof(uint64_t) (%lu != %lu)\n", sizeof(timestamp_t), sizeof(uint64_t));
@@ -164,6 +346,7 @@ void LAMP_init(uint32_t num_instrs, uint32_t num_loops, uint64_t mem_gran, uint6
 	abort();
     }
 
+    lamp_params.num_instrs = num_instrs;
     lamp_params.mem_gran = mem_gran;
     lamp_params.mem_gran_mask = ~0x0;
     lamp_params.mem_gran_shift = 0;
@@ -190,29 +373,59 @@ void LAMP_init(uint32_t num_instrs, uint32_t num_loops, uint64_t mem_gran, uint6
         lamp_params.profile_flow = false;
     }
 
+    // LAMP_PROFILE_TRACE_BUFFER=<records> queues accesses in a per-thread
+    // buffer that is analyzed in batches, by a separate thread if
+    // LAMP_PROFILE_TRACE_THREAD is also set
+    lamp_params.trace_records = 0;
+    lamp_params.trace_thread = false;
+    if (getenv("LAMP_PROFILE_TRACE_BUFFER") != NULL) {
+        lamp_params.trace_records = strtoull(getenv("LAMP_PROFILE_TRACE_BUFFER"), NULL, 0);
+        if (lamp_params.trace_records == 0)
+            lamp_params.trace_records = DEFAULT_TRACE_RECORDS;
+        lamp_params.trace_thread = (getenv("LAMP_PROFILE_TRACE_THREAD") != NULL);
+    }
+
+    // LAMP_PROFILE_SAMPLE_PERIOD=<n> profiles only the first
+    // LAMP_PROFILE_SAMPLE_BURST of every n loop iterations. The first
+    // SAMPLE_WARMUP iterations of each burst only stamp stores, so the
+    // burst must be longer than that.
+    lamp_params.sample_period = 0;
+    lamp_params.sample_burst = SAMPLE_WARMUP + 1;
+    if (getenv("LAMP_PROFILE_SAMPLE_PERIOD") != NULL) {
+        lamp_params.sample_period = strtoull(getenv("LAMP_PROFILE_SAMPLE_PERIOD"), NULL, 0);
+        if (getenv("LAMP_PROFILE_SAMPLE_BURST") != NULL)
+            lamp_params.sample_burst = strtoull(getenv("LAMP_PROFILE_SAMPLE_BURST"), NULL, 0);
+        if ((lamp_params.sample_burst <= SAMPLE_WARMUP) || (lamp_params.sample_burst >= lamp_params.sample_period)) {
+            fprintf(stderr, "LAMP: sample burst %" PRIu64 " must be in (%" PRIu64 ", %" PRIu64 "), profiling every iteration\n",
+                    lamp_params.sample_burst, SAMPLE_WARMUP, lamp_params.sample_period);
+            lamp_params.sample_period = 0;
+            lamp_params.sample_burst = SAMPLE_WARMUP + 1;
+        }
+    }
+
+    // Accesses that only need their page stamped or checked can skip the
+    // analysis unless every access has to be seen
+    lamp_params.fast_path = (lamp_params.trace_records == 0) && (lamp_params.sample_period == 0)
+	&& !lamp_params.silent_stores && lamp_params.profile_flow && !lamp_params.profile_output;
+
     lamp_stats.start_time = clock();
-    lamp_stats.dyn_stores= 0;
-    lamp_stats.dyn_loads= 0;
     lamp_stats.nest_depth = 0;
     lamp_stats.num_sync_arcs = 0;
- 
-    external_call_id = 0;
-
-    memoryProfiler = new MemoryProfilerType(num_instrs);
 
-    // timestamp 0 is the special first "iteration" of main
-    loop_hierarchy.loopIteration(0);
+    install_hooks();
 
-    LoopInfoType &loopInfo = loop_hierarchy.getCurrentLoop();
-    DependenceSets dependenceSets(MemoryProfilerType::MAX_TRACKED_DISTANCE);
-    loopInfo.setItem(dependenceSets);
+    if (lamp_params.trace_records != 0)
+        pthread_key_create(&trace_flush_key, flush_trace);
 
-    time_stamp = 1;
+    // The initializing thread is thread 0
+    getThreadState();
 
-    pageCache = PageCache(num_instrs);
-    Pages pages(memory_stamp);
-    for (uint32_t i = 0; i < num_instrs; i++) {
-	pageCache[i] = pages;
+    if (lamp_params.trace_thread) {
+        trace_consumer_stop = false;
+        if (pthread_create(&trace_consumer_thread, NULL, trace_consumer, NULL) != 0) {
+            fprintf(stderr, "Unable to start trace consumer thread\n");
+            abort();
+        }
     }
 
 		LAMP_initialized = 1;
@@ -225,13 +438,125 @@ void LAMP_init_st() {
 }
 
 void LAMP_finish() {
-    *(lamp_params.lamp_out)<<*memoryProfiler;
+    if (lamp_params.trace_thread) {
+	trace_consumer_stop = true;
+	pthread_join(trace_consumer_thread, NULL);
+	lamp_params.trace_thread = false;
+    }
+
+    Locks::ScopedLock lock(thread_states_lock);
+
+    MemoryProfilerType memoryProfiler(lamp_params.num_instrs);
+    for (uint32_t i = 0; i < thread_states.size(); i++) {
+	if (thread_states[i]->trace != NULL)
+	    drain_trace(*thread_states[i]);
+	memoryProfiler.merge(thread_states[i]->memoryProfiler);
+    }
+
+    if (!lamp_params.text_output) {
+	LAMP_write_profile(lamp_params.profile_out, memoryProfiler);
+	fclose(lamp_params.profile_out);
+	return;
+    }
+
+    // Lets the reader scale counts back up to the whole run
+    if (lamp_params.sample_period != 0) {
+	*(lamp_params.lamp_out)<<"SAMPLING "<<lamp_params.sample_period<<" "<<sample_recorded()<<endl;
+    }
+
+    *(lamp_params.lamp_out)<<memoryProfiler;
     LAMP_print_stats(*(lamp_params.lamp_out));
 }
 
-static LoopInfoType &fillInDependence(const timestamp_t value, Dependence &dep) {
-    const uint64_t store_time_stamp = value.timestamp;
+static bool record_less(const lamp_profile_record_t &r1, const lamp_profile_record_t &r2) {
+    return lamp_profile_record_compare(&r1, &r2) < 0;
+}
+
+// Writes the binary profile: header, records grouped by loop, loop index
+static void LAMP_write_profile(FILE *file, const MemoryProfilerType &memoryProfiler) {
+    vector<MemoryProfilerType::ProfileEntry> entries;
+    memoryProfiler.getEntries(entries);
+
+    vector<lamp_profile_record_t> records(entries.size());
+    for (uint64_t i = 0; i < entries.size(); i++) {
+	const Dependence &dep = entries[i].first;
+	records[i].load = dep.load;
+	records[i].dist = dep.dist;
+	records[i].loop = dep.loop;
+	records[i].store = dep.store;
+	records[i].total_count = entries[i].second->getTotalCount();
+	records[i].loop_count = entries[i].second->getLoopCount();
+    }
+    sort(records.begin(), records.end(), record_less);
+
+    int64_t dyn_stores, dyn_loads;
+    uint32_t max_depth;
+    sum_thread_stats(dyn_stores, dyn_loads, max_depth);
+
+    lamp_profile_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.sample_period = lamp_params.sample_period;
+    header.sample_burst = sample_recorded();
+    header.num_threads = thread_states.size();
+    header.max_depth = max_depth;
+    header.dyn_stores = dyn_stores;
+    header.dyn_loads = dyn_loads;
+    header.run_time_usec = (uint64_t) (1000000.0 * (clock() - lamp_stats.start_time) / CLOCKS_PER_SEC);
+
+    if (lamp_profile_write(file, &header, records.empty() ? NULL : &records[0], records.size()) != 0) {
+	fprintf(stderr, "Unable to write %s\n", lamp_params.profile_file.c_str());
+	abort();
+    }
+}
+
+/***** sampling *****/
+
+// Windows are counted in loop iterations. Time stamps advance once per
+// iteration, so the hooks (on sample_clock) and the analysis (on
+// time_stamp) agree on them even when trace records are replayed later.
+//
+// Stores are stamped throughout a window, but dependences are only
+// recorded after its first SAMPLE_WARMUP iterations, which leaves every
+// recorded load MAX_DEP_DIST iterations of stores to depend on. Iterations
+// of all loops count towards a window, so a dependence carried by an outer
+// loop is only seen if a whole outer iteration fits in the window; sampled
+// profiles mostly miss those.
+static bool in_sample_window(const uint64_t time) {
+    return (lamp_params.sample_period == 0)
+	|| (((time - 1) % lamp_params.sample_period) < lamp_params.sample_burst);
+}
+
+static bool in_sample_record(const uint64_t time) {
+    return (lamp_params.sample_period == 0)
+	|| ((((time - 1) % lamp_params.sample_period) >= SAMPLE_WARMUP)
+	    && in_sample_window(time));
+}
+
+// Accesses outside the window are not tracked, so a stamp older than the
+// window may have been overwritten since. Treat it as unknown, along with
+// stamps from other threads, whose windows do not line up with ours.
+static bool is_stamp_known(const ThreadState &state, const timestamp_t value) {
+    if (lamp_params.sample_period == 0)
+	return true;
+
+    const uint64_t window_start = state.fast.time_stamp - ((state.fast.time_stamp - 1) % lamp_params.sample_period);
+    return (value.thread == state.fast.thread_id) && (value.timestamp >= window_start);
+}
+
+static LoopInfoType &fillInDependence(ThreadState &state, const timestamp_t value, Dependence &dep) {
+    Loops &loop_hierarchy = state.loop_hierarchy;
     dep.store = value.instr;
+
+    if (value.thread != state.fast.thread_id) {
+	// Another thread's time stamps say nothing about this thread's loops,
+	// so count the dependence as carried by the outermost context.
+	LoopInfoType &loop = loop_hierarchy.loop_info[0];
+	dep.loop = loop.loop_id;
+	dep.dist = MemoryProfilerType::MAX_TRACKED_DISTANCE - 1;
+	return loop;
+    }
+
+    const uint64_t store_time_stamp = value.timestamp;
     LoopInfoType &loop = loop_hierarchy.findLoop(store_time_stamp);
     dep.loop = loop.loop_id;
     dep.dist = loop_hierarchy.calculateDistance(loop, store_time_stamp);
@@ -239,111 +564,86 @@ static LoopInfoType &fillInDependence(const timestamp_t value, Dependence &dep)
     return loop;
 }
 
-template <class T>
-static void memory_profile(const uint32_t destId, const uint64_t addr) {
-    Pages &pages = pageCache.at(destId);
-    const timestamp_t *last_store = NULL;
+template <class Mode>
+static void profile_dependence(ThreadState &state, const uint32_t destId, const timestamp_t &store_value, const uint64_t count) {
+    // output dependences of stores made during the warm-up
+    if (!in_sample_record(state.fast.time_stamp))
+	return;
 
-    //debug()<<"ML "<<destId<<" "<<(void *) addr<<" "<<sizeof(T)<<" :: ";
-    // cerr<<"ML "<<destId<<" "<<(void *) addr<<" "<<sizeof(T)<<" :: ";
+    if (!is_stamp_known(state, store_value))
+	return;
 
-    uint8_t i = 0;
-    do {
-	const timestamp_t *store_value = pages.getStampPage()->getItem((void *) (addr + i));
-	if (store_value == NULL) {
-			//debug()<<"U ";
-	    continue;
-	}
+    Dependence dep(destId);
+    LoopInfoType &loopInfo = fillInDependence(state, store_value, dep); // fill dep data and get the loop 
 
-	if ((last_store != NULL) && (*store_value == *last_store)) {
-	    //debug()<<"E ";
-	    continue;
-	}
-	
-	//debug()<<"N ";
+    dep.dist = MemoryProfilerType::trackedDistance(dep.dist); // limit the max to be 1: only care if cross-iter or not
+    MemoryProfile &profile = state.memoryProfiler.increment(dep, count);
 
-	last_store = store_value;
+    if (Mode::measure_iterations)
+	profile.incrementLoop(loopInfo.getItem());
+}
 
-	Dependence dep(destId);
-	LoopInfoType &loopInfo = fillInDependence(*store_value, dep); // fill dep data and get the loop 
+template <class Mode, class T>
+static void memory_profile(ThreadState &state, const uint32_t destId, const uint64_t addr) {
+    Pages &pages = state.pageCache.at(destId);
 
-	dep.dist = MemoryProfilerType::trackedDistance(dep.dist); // limit the max to be 1: only care if cross-iter or not
-	MemoryProfile &profile = memoryProfiler->increment(dep);
+    //debug()<<"ML "<<destId<<" "<<(void *) addr<<" "<<sizeof(T)<<" :: ";
+    // cerr<<"ML "<<destId<<" "<<(void *) addr<<" "<<sizeof(T)<<" :: ";
 
-	if (lamp_params.measure_iterations) {
-	    DependenceSets &dependenceSets = loopInfo.getItem();
-	    pair<DependenceSet::iterator, bool> result = dependenceSets[dep.dist].insert(dep);
-	    if (result.second) {
-		profile.incrementLoop();
-	    }
-	}
-    } while ((++i) < sizeof(T));
+    // One stamp per distinct store covering the load, usually just one
+    const timestamp_t *stores[sizeof(T)];
+    const uint8_t num_stores = pages.getStampPage()->get_stamps((void *) addr, sizeof(T), stores);
+
+    for (uint8_t i = 0; i < num_stores; i++) {
+	profile_dependence<Mode>(state, destId, *stores[i], 1);
+    }
 
     //debug()<<endl;
 }
 
-template <class T>
-static void LAMP_aligned_load(const uint32_t instr, const uint64_t addr) {
-    if (!LAMP_initialized) return;
-	  
-    Pages &pages = pageCache.at(instr);
+/// Profiles each stamp of a range, counting it once per byte it covers.
+template <class Mode>
+struct RangeProfiler {
+    ThreadState &state;
+    const uint32_t destId;
+
+    RangeProfiler(ThreadState &s, const uint32_t id) : state(s), destId(id) {}
+
+    void operator()(const timestamp_t &store_value, const uint64_t bytes) {
+	profile_dependence<Mode>(state, destId, store_value, bytes);
+    }
+};
+
+template <class Mode, class T>
+static void LAMP_aligned_load(ThreadState &state, const uint32_t instr, const uint64_t addr) {
+    Pages &pages = state.pageCache.at(instr);
 
     if (!pages.getStampPage()->inPage((void *) addr)) {
 	pages.setStampPage(memory_stamp.get_or_create_node((void *) addr));
     }
 
-    if (lamp_params.profile_flow) {
-        memory_profile<T>(instr, addr);
+    if (Mode::profile_flow) {
+        memory_profile<Mode, T>(state, instr, addr);
     }
 }
 
-template <class T>
-static void LAMP_unaligned_load(const uint32_t instr, const uint64_t addr) {
+template <class Mode, class T>
+static void LAMP_unaligned_load(ThreadState &state, const uint32_t instr, const uint64_t addr) {
     for (uint8_t i = 0; i < sizeof(T); i++) {
-	LAMP_aligned_load<uint8_t>(instr, addr + i);
+	LAMP_aligned_load<Mode, uint8_t>(state, instr, addr + i);
     }
 }
 
-template <class T>
-void LAMP_load(const uint32_t instr, const uint64_t addr) {
-    lamp_stats.dyn_loads++;
-
+template <class Mode, class T>
+static void analyze_load(ThreadState &state, const uint32_t instr, const uint64_t addr) {
     if (!Memory::is_aligned<T>(addr)) {
-	LAMP_unaligned_load<T>(instr, addr);
+	LAMP_unaligned_load<Mode, T>(state, instr, addr);
     } else {
-	LAMP_aligned_load<T>(instr, addr);
-    }
-}
-
-void LAMP_load1(const uint32_t instr, const uint64_t addr) {
-    LAMP_load<uint8_t>(instr, addr);
-}
-
-void LAMP_load2(const uint32_t instr, const uint64_t addr) {
-    LAMP_load<uint16_t>(instr, addr);
-}
-
-void LAMP_load4(const uint32_t instr, const uint64_t addr) {
-    LAMP_load<uint32_t>(instr, addr);
-}
-
-void LAMP_load8(const uint32_t instr, const uint64_t addr) {
-    LAMP_load<uint64_t>(instr, addr);
-}
-
-
-void LAMP_external_load(const void * src, const uint64_t size) {
-    const uint64_t cptr = (uint64_t) (intptr_t) src;
-    for (uint64_t i = 0; i < size; i++) {
-	const uint64_t addr = cptr + i;
-	// MJB: It is important that src not be dereferenced, as it may not longer be valid
-	// (ex. if realloc freed the src pointer)
-	
-	LAMP_load1(external_call_id, addr);
+	LAMP_aligned_load<Mode, T>(state, instr, addr);
     }
 }
 
-static timestamp_t form_timestamp(uint32_t instr, uint64_t timestamp) {
+static timestamp_t form_timestamp(uint32_t instr, uint32_t thread, uint64_t timestamp) {
     if (timestamp > TIME_STAMP_MAX) {
         fprintf(stderr, "TIME STAMP too large\n");
         abort();
@@ -356,142 +656,422 @@ static timestamp_t form_timestamp(uint32_t instr, uint64_t timestamp) {
 
     timestamp_t ts;
     ts.timestamp = timestamp;
+    ts.thread = thread;
     ts.instr = instr;
     return ts;
 }
 
-template<class T>
-static void LAMP_aligned_store(uint32_t instrId, uint64_t addr) {
-    if (!LAMP_initialized) return;
-
-    Pages &pages = pageCache.at(instrId);
+template<class Mode, class T>
+static void LAMP_aligned_store(ThreadState &state, uint32_t instrId, uint64_t addr) {
+    Pages &pages = state.pageCache.at(instrId);
     if (!pages.getStampPage()->inPage((void *) addr)) {
 	pages.setStampPage(memory_stamp.get_or_create_node((void *) addr));
     }
 
-    if (lamp_params.profile_output) {
-        memory_profile<T>(instrId, addr);
+    if (Mode::profile_output) {
+        memory_profile<Mode, T>(state, instrId, addr);
     }
 
-    const timestamp_t val = form_timestamp(instrId, time_stamp);
+    const timestamp_t val = form_timestamp(instrId, state.fast.thread_id, state.fast.time_stamp);
     //debug()<<"S "<<instrId<<" "<<(void *) addr<<" "<<sizeof(T)<<" "<<val<<" ";
 
-    for (uint8_t i = 0; i < sizeof(T); i++) {
-	//debug()<<"S ";
-	pages.getStampPage()->setItem((void *) (addr + i), val);
-    }
+    pages.getStampPage()->stamp((void *) addr, sizeof(T), val);
 
     //debug()<<endl;
 }
 
-template<class T>
-static void LAMP_unaligned_store(uint32_t instrId, uint64_t addr) {
+template<class Mode, class T>
+static void LAMP_unaligned_store(ThreadState &state, uint32_t instrId, uint64_t addr) {
     for (uint8_t i = 0; i < sizeof(T); i++) {
-	LAMP_aligned_store<uint8_t>(instrId, addr + i);
+	LAMP_aligned_store<Mode, uint8_t>(state, instrId, addr + i);
+    }
+}
+
+template<class Mode, class T>
+static void analyze_store(ThreadState &state, uint32_t instrId, uint64_t addr) {
+    if (!Memory::is_aligned<T>(addr)) {
+	LAMP_unaligned_store<Mode, T>(state, instrId, addr);
+    } else {
+	LAMP_aligned_store<Mode, T>(state, instrId, addr);
     }
 }
 
-template<class T>
+// The range operations below give the same profile as a one byte access
+// at each address in the range, but handle a page at a time.
+
+template <class Mode>
+static void analyze_load_range(ThreadState &state, uint32_t instrId, uint64_t addr, uint64_t size) {
+    if (!Mode::profile_flow)
+	return;
+
+    RangeProfiler<Mode> profiler(state, instrId);
+    while (size > 0) {
+	const uint64_t chunk = MemoryStamp::page_chunk(addr, size);
+	memory_stamp.get_or_create_node((void *) addr)->visit_stamps((void *) addr, chunk, profiler);
+	addr += chunk;
+	size -= chunk;
+    }
+}
+
+template <class Mode>
+static void analyze_store_range(ThreadState &state, uint32_t instrId, uint64_t addr, uint64_t size) {
+    const timestamp_t val = form_timestamp(instrId, state.fast.thread_id, state.fast.time_stamp);
+
+    RangeProfiler<Mode> profiler(state, instrId);
+    while (size > 0) {
+	const uint64_t chunk = MemoryStamp::page_chunk(addr, size);
+	StampPageType *page = memory_stamp.get_or_create_node((void *) addr);
+	if (Mode::profile_output)
+	    page->visit_stamps((void *) addr, chunk, profiler);
+	page->stamp_range((void *) addr, chunk, val);
+	addr += chunk;
+	size -= chunk;
+    }
+}
+
+static void invalidate_region(const void *memory, size_t size) {
+    memory_stamp.set_invalid_range(memory, size);
+}
+
+template <class Mode>
+static void analyze_deallocate(ThreadState &state, uint32_t lampId, const void *memory, size_t size) {
+    analyze_store_range<Mode>(state, lampId, (uint64_t) memory, size);
+    invalidate_region(memory, size);
+}
+
+template <class Mode>
+static void beginIterationEpoch(ThreadState &state) {
+    if (!Mode::measure_iterations)
+	return;
+
+    // Forgets every dependence seen in the loop's previous iteration
+    state.loop_hierarchy.getCurrentLoop().setItem(++state.iteration_epoch);
+}
+
+template <class Mode>
+static void analyze_loop_iteration(ThreadState &state) {
+    state.fast.time_stamp++;
+    state.loop_hierarchy.loopIteration(state.fast.time_stamp);
+    beginIterationEpoch<Mode>(state);
+}
+
+template <class Mode>
+static void analyze_loop_invocation(ThreadState &state, const uint16_t loop) {
+    state.loop_hierarchy.enterLoop(loop, state.fast.time_stamp);
+    beginIterationEpoch<Mode>(state);
+}
+
+/***** trace buffering *****/
+
+/// Replays one thread's trace records through the analysis.
+template <class Mode>
+struct TraceReplayer {
+    ThreadState &state;
+
+    TraceReplayer(ThreadState &s) : state(s) {}
+
+    void operator()(const TraceRecord &record) {
+	switch (record.kind) {
+	case TRACE_LOAD:
+	    switch (record.size) {
+	    case 1: analyze_load<Mode, uint8_t>(state, record.id, record.addr); break;
+	    case 2: analyze_load<Mode, uint16_t>(state, record.id, record.addr); break;
+	    case 4: analyze_load<Mode, uint32_t>(state, record.id, record.addr); break;
+	    default: analyze_load<Mode, uint64_t>(state, record.id, record.addr); break;
+	    }
+	    break;
+	case TRACE_STORE:
+	    switch (record.size) {
+	    case 1: analyze_store<Mode, uint8_t>(state, record.id, record.addr); break;
+	    case 2: analyze_store<Mode, uint16_t>(state, record.id, record.addr); break;
+	    case 4: analyze_store<Mode, uint32_t>(state, record.id, record.addr); break;
+	    default: analyze_store<Mode, uint64_t>(state, record.id, record.addr); break;
+	    }
+	    break;
+	case TRACE_ALLOCATE:
+	    invalidate_region((const void *) record.addr, record.size);
+	    break;
+	case TRACE_DEALLOCATE:
+	    analyze_deallocate<Mode>(state, record.id, (const void *) record.addr, record.size);
+	    break;
+	case TRACE_LOOP_INVOCATION:
+	    analyze_loop_invocation<Mode>(state, record.id);
+	    break;
+	case TRACE_LOOP_ITERATION:
+	    analyze_loop_iteration<Mode>(state);
+	    break;
+	case TRACE_LOOP_EXIT:
+	    state.loop_hierarchy.exitLoop();
+	    break;
+	case TRACE_LOAD_RANGE:
+	    analyze_load_range<Mode>(state, record.id, record.addr, record.size);
+	    break;
+	case TRACE_STORE_RANGE:
+	    analyze_store_range<Mode>(state, record.id, record.addr, record.size);
+	    break;
+	default:
+	    fprintf(stderr, "Unknown trace record kind %u\n", record.kind);
+	    abort();
+	}
+    }
+};
+
+template <class Mode>
+static uint64_t replay_trace(ThreadState &state) {
+    TraceReplayer<Mode> replayer(state);
+    return state.trace->drain(replayer);
+}
+
+static void trace(ThreadState &state, uint32_t kind, uint32_t id, uint64_t addr, uint64_t size) {
+    TraceRecord record;
+    record.addr = addr;
+    record.id = id;
+    record.kind = kind;
+
+    // Allocations can be larger than a record's size field
+    do {
+	const uint64_t chunk = (size > TRACE_SIZE_MAX) ? TRACE_SIZE_MAX : size;
+	record.size = chunk;
+
+	while (!state.trace->push(record)) {
+	    if (lamp_params.trace_thread)
+		sched_yield();
+	    else
+		drain_trace(state);
+	}
+
+	record.addr += chunk;
+	size -= chunk;
+    } while (size > 0);
+}
+
+// Runs as a thread exits. Finishing its trace before pthread_join returns
+// keeps the thread's accesses ordered before whatever the joining thread
+// does next.
+static void flush_trace(void *arg) {
+    ThreadState &state = *(ThreadState *) arg;
+    if (lamp_params.trace_thread) {
+	while (!state.trace->empty())
+	    sched_yield();
+    } else {
+	drain_trace(state);
+    }
+}
+
+static void *trace_consumer(void *arg) {
+    while (!trace_consumer_stop) {
+	vector<ThreadState *> states;
+	{
+	    Locks::ScopedLock lock(thread_states_lock);
+	    states = thread_states;
+	}
+
+	uint64_t drained = 0;
+	for (uint32_t i = 0; i < states.size(); i++) {
+	    drained += drain_trace(*states[i]);
+	}
+
+	if (drained == 0)
+	    sched_yield();
+    }
+    return NULL;
+}
+
+/***** hooks *****/
+
+template <class Mode, class T>
+static void LAMP_load(const uint32_t instr, const uint64_t addr) {
+    if (LAMP_fast_load<T>(instr, addr))
+	return;
+
+    ThreadState &state = getThreadState();
+    state.fast.dyn_loads++;
+
+    if (!in_sample_record(state.sample_clock))
+	return;
+
+    if (state.trace != NULL)
+	trace(state, TRACE_LOAD, instr, addr, sizeof(T));
+    else
+	analyze_load<Mode, T>(state, instr, addr);
+}
+
+void LAMP_load1(const uint32_t instr, const uint64_t addr) {
+    lamp_hooks.load[0](instr, addr);
+}
+
+void LAMP_load2(const uint32_t instr, const uint64_t addr) {
+    lamp_hooks.load[1](instr, addr);
+}
+
+void LAMP_load4(const uint32_t instr, const uint64_t addr) {
+    lamp_hooks.load[2](instr, addr);
+}
+
+void LAMP_load8(const uint32_t instr, const uint64_t addr) {
+    lamp_hooks.load[3](instr, addr);
+}
+
+
+void LAMP_external_load(const void * src, const uint64_t size) {
+    if (!LAMP_initialized) return;
+
+    // MJB: It is important that src not be dereferenced, as it may not longer be valid
+    // (ex. if realloc freed the src pointer)
+    const uint64_t cptr = (uint64_t) (intptr_t) src;
+
+    // Counted and profiled as size one byte loads
+    ThreadState &state = getThreadState();
+    state.fast.dyn_loads += size;
+
+    if (!in_sample_record(state.sample_clock))
+	return;
+
+    if (state.trace != NULL)
+	trace(state, TRACE_LOAD_RANGE, state.external_call_id, cptr, size);
+    else
+	lamp_hooks.load_range(state, state.external_call_id, cptr, size);
+}
+
+template<class Mode, class T>
 static bool is_silent_store(const uint32_t instr, const uint64_t addr, const uint64_t value) {
-    if (!lamp_params.silent_stores)
+    if (!Mode::silent_stores)
         return false;
 
     return (*((const T *) addr) == ((T) value));
 }
 
-template<class T>
-void LAMP_store(uint32_t instrID, uint64_t addr, uint64_t value) {
-    lamp_stats.dyn_stores++;
+template<class Mode, class T>
+static void LAMP_store(uint32_t instrID, uint64_t addr, uint64_t value) {
+    if (LAMP_fast_store<T>(instrID, addr))
+	return;
+
+    ThreadState &state = getThreadState();
+    state.fast.dyn_stores++;
+
+    if (!in_sample_window(state.sample_clock))
+	return;
 
-    if (is_silent_store<T>(instrID, addr, value))
+    if (is_silent_store<Mode, T>(instrID, addr, value))
         return;
 
-    if (!Memory::is_aligned<T>(addr)) {
-	LAMP_unaligned_store<T>(instrID, addr);
-    } else {
-	LAMP_aligned_store<T>(instrID, addr);
-    }
+    if (state.trace != NULL)
+	trace(state, TRACE_STORE, instrID, addr, sizeof(T));
+    else
+	analyze_store<Mode, T>(state, instrID, addr);
+}
+
+template <class Mode>
+static void install_hooks(void) {
+    lamp_hooks.load[0] = LAMP_load<Mode, uint8_t>;
+    lamp_hooks.load[1] = LAMP_load<Mode, uint16_t>;
+    lamp_hooks.load[2] = LAMP_load<Mode, uint32_t>;
+    lamp_hooks.load[3] = LAMP_load<Mode, uint64_t>;
+    lamp_hooks.store[0] = LAMP_store<Mode, uint8_t>;
+    lamp_hooks.store[1] = LAMP_store<Mode, uint16_t>;
+    lamp_hooks.store[2] = LAMP_store<Mode, uint32_t>;
+    lamp_hooks.store[3] = LAMP_store<Mode, uint64_t>;
+    lamp_hooks.load_range = analyze_load_range<Mode>;
+    lamp_hooks.store_range = analyze_store_range<Mode>;
+    lamp_hooks.deallocate = analyze_deallocate<Mode>;
+    lamp_hooks.loop_iteration = analyze_loop_iteration<Mode>;
+    lamp_hooks.loop_invocation = analyze_loop_invocation<Mode>;
+    lamp_hooks.drain_trace = replay_trace<Mode>;
+}
+
+static void install_hooks(void) {
+    // profile_flow is always !profile_output
+    static void (*const installers[8])(void) = {
+	install_hooks<HookMode<false, false, false> >,
+	install_hooks<HookMode<false, false, true> >,
+	install_hooks<HookMode<false, true, false> >,
+	install_hooks<HookMode<false, true, true> >,
+	install_hooks<HookMode<true, false, false> >,
+	install_hooks<HookMode<true, false, true> >,
+	install_hooks<HookMode<true, true, false> >,
+	install_hooks<HookMode<true, true, true> >,
+    };
+
+    installers[(lamp_params.profile_output ? 4 : 0)
+	       | (lamp_params.silent_stores ? 2 : 0)
+	       | (lamp_params.measure_iterations ? 1 : 0)]();
 }
 
 void LAMP_store1(uint32_t instr, uint64_t addr, uint64_t value) {
-    LAMP_store<uint8_t>(instr, addr, value);
+    lamp_hooks.store[0](instr, addr, value);
 }
 
 void LAMP_store2(uint32_t instr, uint64_t addr, uint64_t value) {
-    LAMP_store<uint16_t>(instr, addr, value);
+    lamp_hooks.store[1](instr, addr, value);
 }
 
 void LAMP_store4(uint32_t instr, uint64_t addr, uint64_t value) {
-    LAMP_store<uint32_t>(instr, addr, value);
+    lamp_hooks.store[2](instr, addr, value);
 }
 
 void LAMP_store8(uint32_t instr, uint64_t addr, uint64_t value) {
-    LAMP_store<uint64_t>(instr, addr, value);
+    lamp_hooks.store[3](instr, addr, value);
 }
 
 void LAMP_external_store(const void * dest, const uint64_t size) {
-    const uint64_t cptr = (uint64_t) (intptr_t) dest;
-    for (uint64_t i = 0; i < size; i++) {
-	const uint64_t addr = cptr + i;
+    if (!LAMP_initialized) return;
 
-	LAMP_aligned_store<uint8_t>(external_call_id, addr);
-    }
-}
+    ThreadState &state = getThreadState();
+    if (!in_sample_window(state.sample_clock))
+	return;
 
-static void invalidate_region(const void *memory, size_t size) {
-    for (uint64_t i = 0; i < size; i++) {
-	memory_stamp.set_invalid<uint8_t>((uint8_t*)memory+i);
-    }
+    const uint64_t cptr = (uint64_t) (intptr_t) dest;
+    if (state.trace != NULL)
+	trace(state, TRACE_STORE_RANGE, state.external_call_id, cptr, size);
+    else
+	lamp_hooks.store_range(state, state.external_call_id, cptr, size);
 }
 
 void LAMP_allocate(uint32_t lampId, const void *memory, size_t size) {
-    invalidate_region(memory, size);
+    if (LAMP_initialized && (getThreadState().trace != NULL))
+	trace(getThreadState(), TRACE_ALLOCATE, lampId, (uint64_t) memory, size);
+    else
+	invalidate_region(memory, size);
 }
 
 void LAMP_deallocate(uint32_t lampId, const void *memory, size_t size) {
-    for (uint64_t i = 0; i < size; i++) {
-        LAMP_aligned_store<uint8_t>(lampId, ((uint64_t)memory+i));
+    if (!LAMP_initialized) {
+	invalidate_region(memory, size);
+	return;
     }
-    invalidate_region(memory, size);
+
+    ThreadState &state = getThreadState();
+    if (state.trace != NULL)
+	trace(state, TRACE_DEALLOCATE, lampId, (uint64_t) memory, size);
+    else
+	lamp_hooks.deallocate(state, lampId, memory, size);
 }
 
 void LAMP_external_allocate(const void *memory, size_t size) {
-    LAMP_allocate(external_call_id, memory, size);
+    if (!LAMP_initialized) return;
+
+    LAMP_allocate(getThreadState().external_call_id, memory, size);
 }
 
 void LAMP_external_deallocate(const void *memory, size_t size) {
-    LAMP_deallocate(external_call_id, memory, size);
+    if (!LAMP_initialized) return;
+
+    LAMP_deallocate(getThreadState().external_call_id, memory, size);
 }
 
 void LAMP_allocate_st(void) {
     LAMP_allocate((uint32_t) LAMP_param1, (void *) LAMP_param2, (size_t) LAMP_param3);
 }
 
-
-static void initializeSets() {
-    if (!lamp_params.measure_iterations)
-	return;
-
-    LoopInfoType &loopInfo = loop_hierarchy.getCurrentLoop();
-    DependenceSets &dependenceSets = loopInfo.getItem();
-
-    if (dependenceSets.size() != MemoryProfilerType::MAX_TRACKED_DISTANCE) {
-	for (uint32_t i = dependenceSets.size(); i < MemoryProfilerType::MAX_TRACKED_DISTANCE; i++) {
-	    DependenceSet seta;
-	    dependenceSets.push_back(seta);
-	}
-    }
-    
-    DependenceSets::iterator viter = dependenceSets.begin();
-    for (; viter != dependenceSets.end(); viter++) {
-	viter->clear();
-    }
-}
-
 void LAMP_loop_iteration_begin(void) {
-    time_stamp++;
-    loop_hierarchy.loopIteration(time_stamp);
-    initializeSets();
+    if (!LAMP_initialized) return;
+
+    ThreadState &state = getThreadState();
+    state.sample_clock++;
+    if (state.trace != NULL)
+	trace(state, TRACE_LOOP_ITERATION, 0, 0, 0);
+    else
+	lamp_hooks.loop_iteration(state);
 }
 
 void LAMP_loop_iteration_end(void) {
@@ -507,7 +1087,13 @@ void LAMP_loop_iteration_end_st(void) {
 }
 
 void LAMP_loop_exit(void) {
-    loop_hierarchy.exitLoop();
+    if (!LAMP_initialized) return;
+
+    ThreadState &state = getThreadState();
+    if (state.trace != NULL)
+	trace(state, TRACE_LOOP_EXIT, 0, 0, 0);
+    else
+	state.loop_hierarchy.exitLoop();
 }
 
 void LAMP_loop_exit_st(void) {
@@ -515,8 +1101,13 @@ void LAMP_loop_exit_st(void) {
 }
 
 void LAMP_loop_invocation(const uint16_t loop) {
-    loop_hierarchy.enterLoop(loop, time_stamp);
-    initializeSets();
+    if (!LAMP_initialized) return;
+
+    ThreadState &state = getThreadState();
+    if (state.trace != NULL)
+	trace(state, TRACE_LOOP_INVOCATION, loop, 0, 0);
+    else
+	lamp_hooks.loop_invocation(state, loop);
 }
  
 void LAMP_loop_invocation_st(void) {
@@ -525,7 +1116,8 @@ void LAMP_loop_invocation_st(void) {
 }
 
 void LAMP_register(uint32_t id) {
-    external_call_id = id;
+    if (LAMP_initialized)
+	getThreadState().external_call_id = id;
     LAMP_param1 = id;
 }
 
@@ -45,6 +45,17 @@ void LAMP_store2(const uint32_t instr, const uint64_t addr, const uint64_t value
 void LAMP_store4(const uint32_t instr, const uint64_t addr, const uint64_t value);
 void LAMP_store8(const uint32_t instr, const uint64_t addr, const uint64_t value);
 
+// Inlinable versions of the above, defined only in lamp_fast_path.bc
+void LAMP_fast_load1(const uint32_t instr, const uint64_t addr);
+void LAMP_fast_load2(const uint32_t instr, const uint64_t addr);
+void LAMP_fast_load4(const uint32_t instr, const uint64_t addr);
+void LAMP_fast_load8(const uint32_t instr, const uint64_t addr);
+
+void LAMP_fast_store1(const uint32_t instr, const uint64_t addr, const uint64_t value);
+void LAMP_fast_store2(const uint32_t instr, const uint64_t addr, const uint64_t value);
+void LAMP_fast_store4(const uint32_t instr, const uint64_t addr, const uint64_t value);
+void LAMP_fast_store8(const uint32_t instr, const uint64_t addr, const uint64_t value);
+
 void LAMP_finish(void);
 
 void LAMP_allocate(uint32_t lampId, const void *memory, size_t size);
@@ -1,4 +1,9 @@
+#ifndef LOCKS_H
+#define LOCKS_H
+
 #include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 namespace Locks {
@@ -43,8 +48,24 @@ namespace Locks {
         void unlock() {
             pthread_mutex_unlock(&this->m);
         }
+    };
+
+    class ScopedLock {
+    private:
+        Mutex &mutex;
+
+        ScopedLock(const ScopedLock &lock);
+
+        ScopedLock &operator=(const ScopedLock &lock);
 
-     
+    public:
+        ScopedLock(Mutex &m) : mutex(m) {
+            mutex.lock();
+        }
+
+        ~ScopedLock() {
+            mutex.unlock();
+        }
     };
 
     class ReadWriteMutex {
@@ -105,3 +126,5 @@ namespace Locks {
         }
     };
 }
+
+#endif
@@ -67,13 +67,17 @@ namespace Loop {
 
 	vector<LoopInfoType> loop_info;
 
-	LoopHierarchy() : max_depth(0), current_depth(-1), loop_info(maxLoopDepth) {
+	// loop_info[i].invocation_time_stamp, packed for findLoop
+	vector<uint64_t> invocation_stamps;
+
+	LoopHierarchy() : max_depth(0), current_depth(-1), loop_info(maxLoopDepth), invocation_stamps(maxLoopDepth) {
 	    enterLoop(0, 0);
 	}
 	
 	void enterLoop(uint64_t loop_id, uint64_t timestamp) {
 	    this->current_depth++;
 	    this->loop_info.at(this->current_depth).reset(loop_id, timestamp);
+	    this->invocation_stamps[this->current_depth] = timestamp;
 
 	    if (this->current_depth > this->max_depth) {
 		this->max_depth = this->current_depth;
@@ -101,16 +105,32 @@ namespace Loop {
     return this->loop_info.at(this->current_depth);
 	}
 
+	// Invocation time stamps never decrease going down the loop stack, so
+	// the innermost loop invoked before the store is found by a binary
+	// search over the dense copy in invocation_stamps. Stores from the
+	// current loop, the common case, are checked first.
 	LoopInfoType & findLoop(uint64_t store_time_stamp) {
 	    if (store_time_stamp == 0) {
 		return loop_info[0];
 	    }
 
-	    for (uint32_t iter = this->current_depth; iter > 0; iter--) {
-		if (loop_info[iter].invocation_time_stamp < store_time_stamp)
-		    return loop_info[iter];
+	    const uint64_t *stamps = &this->invocation_stamps[0];
+	    if (stamps[this->current_depth] < store_time_stamp)
+		return loop_info[this->current_depth];
+
+	    // Branch-free search for the last depth in [0, current_depth)
+	    // invoked before the store, or 0 if there is none
+	    uint32_t low = 0;
+	    uint32_t count = this->current_depth;
+	    while (count > 1) {
+		const uint32_t half = count / 2;
+		low = (stamps[low + half] < store_time_stamp) ? low + half : low;
+		count -= half;
 	    }
-	    
+
+	    if (low > 0)
+		return loop_info[low];
+
 	    if (this->loop_info[0].invocation_time_stamp > store_time_stamp) {
 		cerr<<"Unexpected time stamp: "<<this->loop_info[0].invocation_time_stamp<<" > "<<store_time_stamp<<endl;
 		abort();
@@ -119,15 +139,17 @@ namespace Loop {
 	    return this->loop_info[0];
 	}
 
+	// The distance is the number of recorded iterations that started after
+	// the store. At most maxDepDistance stamps are kept, newest last, and
+	// they are read straight out of the buffer rather than through its
+	// reverse iterators.
 	uint32_t calculateDistance(LoopInfoType &store_loop, uint64_t store_time_stamp) {
-	    circular_buffer<uint64_t>::reverse_iterator iter = store_loop.iteration_time_stamps.rbegin();
+	    const circular_buffer<uint64_t> &stamps = store_loop.iteration_time_stamps;
+	    const uint32_t size = stamps.size();
 
 	    uint32_t distance = 0;
-	    for (; iter != store_loop.iteration_time_stamps.rend(); iter++) {
-		if (*iter <= store_time_stamp)
-		    break;
+	    while ((distance < size) && (stamps[size - 1 - distance] > store_time_stamp))
 		distance++;
-	    }
 
 	    return distance;
 	}
@@ -0,0 +1,103 @@
+#include "LoopHierarchy.hxx"
+
+#include <stdio.h>
+#include <time.h>
+
+using namespace Loop;
+
+/*
+ * Checks findLoop and calculateDistance against the original linear scans
+ * and times both on a 20-deep loop nest. Queries use store time stamps in
+ * pseudo-random order; a sorted sweep would let the branch predictor learn
+ * the linear scan.
+ */
+
+static const uint32_t NEST_DEPTH = 20;
+static const uint32_t ITERATIONS = 4;
+static const uint32_t QUERIES = 10000000;
+
+typedef LoopHierarchy<int, DEFAULT_LOOP_DEPTH, 2> Loops;
+
+static Loops::LoopInfoType &linearFindLoop(Loops &loops, uint64_t store_time_stamp) {
+    if (store_time_stamp == 0)
+	return loops.loop_info[0];
+
+    for (uint32_t iter = loops.current_depth; iter > 0; iter--) {
+	if (loops.loop_info[iter].invocation_time_stamp < store_time_stamp)
+	    return loops.loop_info[iter];
+    }
+    return loops.loop_info[0];
+}
+
+static uint32_t linearDistance(Loops::LoopInfoType &store_loop, uint64_t store_time_stamp) {
+    circular_buffer<uint64_t>::reverse_iterator iter = store_loop.iteration_time_stamps.rbegin();
+
+    uint32_t distance = 0;
+    for (; iter != store_loop.iteration_time_stamps.rend(); iter++) {
+	if (*iter <= store_time_stamp)
+	    break;
+	distance++;
+    }
+    return distance;
+}
+
+static uint64_t nextStamp(uint32_t &seed, uint64_t max_stamp) {
+    seed = seed * 1103515245 + 12345;
+    return 1 + ((seed >> 8) % max_stamp);
+}
+
+static double elapsed(clock_t start) {
+    return 1.0 * (clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main() {
+    Loops loops;
+    uint64_t time_stamp = 1;
+    loops.loopIteration(0);
+
+    // Enter the nest, running a few iterations at each level
+    for (uint32_t depth = 1; depth <= NEST_DEPTH; depth++) {
+	loops.enterLoop(depth, time_stamp);
+	for (uint32_t i = 0; i < ITERATIONS; i++) {
+	    time_stamp++;
+	    loops.loopIteration(time_stamp);
+	}
+    }
+
+    for (uint64_t stamp = 0; stamp <= time_stamp; stamp++) {
+	Loops::LoopInfoType &loop = loops.findLoop(stamp);
+	if (&loop != &linearFindLoop(loops, stamp)
+	    || loops.calculateDistance(loop, stamp) != linearDistance(loop, stamp)) {
+	    fprintf(stderr, "Mismatch for time stamp %lu\n", (unsigned long) stamp);
+	    return 1;
+	}
+    }
+
+    uint64_t sum = 0;
+    uint32_t seed = 1;
+    clock_t start = clock();
+    for (uint32_t q = 0; q < QUERIES; q++) {
+	const uint64_t stamp = nextStamp(seed, time_stamp);
+	Loops::LoopInfoType &loop = linearFindLoop(loops, stamp);
+	sum += loop.loop_id + linearDistance(loop, stamp);
+    }
+    const double linear_time = elapsed(start);
+
+    seed = 1;
+    start = clock();
+    for (uint32_t q = 0; q < QUERIES; q++) {
+	const uint64_t stamp = nextStamp(seed, time_stamp);
+	Loops::LoopInfoType &loop = loops.findLoop(stamp);
+	sum -= loop.loop_id + loops.calculateDistance(loop, stamp);
+    }
+    const double search_time = elapsed(start);
+
+    if (sum != 0) {
+	fprintf(stderr, "Checksum mismatch\n");
+	return 1;
+    }
+
+    printf("%u-deep nest, %u queries: linear %.3fs, binary search %.3fs\n",
+	   NEST_DEPTH, QUERIES, linear_time, search_time);
+    return 0;
+}
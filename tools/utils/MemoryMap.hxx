@@ -9,13 +9,13 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <new>
 #include "utils.hxx"
 
 #include <iostream>
 using namespace std;
 
-#include <ext/hash_map>
-using namespace __gnu_cxx;
 
 //#define MEMMAP_DEBUG_BYTE
 
@@ -90,18 +90,6 @@ namespace Memory {
     typedef uint64_t addr_t;
     typedef uint64_t pageaddr_t;
 
-    struct PageAddrEquals {
-	bool operator()(const pageaddr_t &page1, const pageaddr_t page2) const {
-	    return page1 == page2;
-	}
-    };
-
-    struct PageAddrHash {
-	size_t operator()(const pageaddr_t &page) const {
-	    return page;
-	}
-    };
-
     enum valid_t {NONE = 0, SOME = 1, ALL = 2};
 
     static const uint64_t DEFAULT_PAGE_BITS = 12;
@@ -292,7 +280,7 @@ namespace Memory {
 
 	void clear() {
 	    memset(this->valid, 0, sizeof(this->valid));
-            memst(this->invalid, 0, sizeof(this->invalid));
+            memset(this->invalid, 0, sizeof(this->invalid));
 	}
 
 	const T *getItem(const void * addr) const {
@@ -358,45 +346,242 @@ namespace Memory {
 	}
     };
 
-    template<class T>
+    /**
+     * Maps page addresses to pages through a radix tree indexed by the
+     * address bits above PAGE_BITS. The upper levels are small pointer
+     * nodes; the last level is a region, a MAP_NORESERVE mapping with room
+     * for every page of its slice of the address space. A page lives at a
+     * fixed offset in its region and is constructed in place on first
+     * touch, so shadow memory is only committed for pages that are used and
+     * no per-page allocation is made. Nodes, regions and pages are published
+     * with a compare-and-swap, so concurrent lookups and insertions need no
+     * lock. clear() and the destructor are not safe against concurrent
+     * access.
+     */
+    template<class T, unsigned int PAGE_BITS = DEFAULT_PAGE_BITS>
     class MemoryMap  {
     private:
 
-	MemoryMap(const MemoryMap<T> &map) {}
+	MemoryMap(const MemoryMap<T, PAGE_BITS> &map) {}
 	
-	MemoryMap &operator=(const MemoryMap<T> &map) {return *this;}
+	MemoryMap &operator=(const MemoryMap<T, PAGE_BITS> &map) {return *this;}
 	
     protected:
-        typedef hash_map<pageaddr_t, T *, PageAddrHash, PageAddrEquals> PageMap;
+	static const unsigned int KEY_BITS = 64 - PAGE_BITS;
+
+	static const unsigned int LEVELS = 4;
+
+	static const unsigned int LEVEL_BITS = ROUND_UP_DIVISION(KEY_BITS, LEVELS);
+
+	static const uint64_t FANOUT = (1ULL << LEVEL_BITS);
+
+	static const uint64_t LEVEL_MASK = FANOUT - 1ULL;
+
+	enum page_state_t {PAGE_EMPTY = 0, PAGE_BUSY = 1, PAGE_READY = 2};
+
+	struct Region {
+	    uint8_t *pages;
+	    Region *next;
+	    uint8_t state[FANOUT];
+
+	    T *page(uint64_t slot) const {
+		return (T *) (this->pages + slot * sizeof(T));
+	    }
+	};
+
+	static const uint64_t REGION_BYTES = FANOUT * sizeof(T);
+
+	void *root[FANOUT];
+
+	// Every region is also kept on a list so that the map can be walked
+	// without visiting the (mostly empty) radix nodes.
+	Region *regions;
+
+	static uint64_t page_key(const void *addr) {
+	    return ((uint64_t) (intptr_t) addr) >> PAGE_BITS;
+	}
+
+	static uint64_t slot_index(uint64_t key, unsigned int level) {
+	    return (key >> ((LEVELS - 1 - level) * LEVEL_BITS)) & LEVEL_MASK;
+	}
+
+	const Region *lookup_region(uint64_t key) const {
+	    void *const *slots = this->root;
+	    for (unsigned int level = 0; level < LEVELS - 2; level++) {
+		void *next = slots[slot_index(key, level)];
+		if (next == NULL)
+		    return NULL;
+		slots = (void *const *) next;
+	    }
+	    return (const Region *) slots[slot_index(key, LEVELS - 2)];
+	}
+
+	T *lookup_page(uint64_t key) const {
+	    const Region *region = lookup_region(key);
+	    if (region == NULL)
+		return NULL;
+
+	    const uint64_t slot = slot_index(key, LEVELS - 1);
+	    if (region->state[slot] != PAGE_READY)
+		return NULL;
+	    return region->page(slot);
+	}
+
+	Region *new_region() {
+	    Region *region = (Region *) calloc(1, sizeof(Region));
+	    void *pages = mmap(NULL, REGION_BYTES, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	    if ((region == NULL) || (pages == MAP_FAILED)) {
+		fprintf(stderr, "Unable to reserve %" PRIu64 " bytes of shadow memory\n", REGION_BYTES);
+		abort();
+	    }
+	    region->pages = (uint8_t *) pages;
+	    return region;
+	}
+
+	static void delete_region(Region *region) {
+	    for (uint64_t slot = 0; slot < FANOUT; slot++) {
+		if (region->state[slot] == PAGE_READY)
+		    region->page(slot)->~T();
+	    }
+	    munmap(region->pages, REGION_BYTES);
+	    free(region);
+	}
 
-        PageMap pageMap;
+	Region *create_region(uint64_t key) {
+	    void **slots = this->root;
+	    for (unsigned int level = 0; level < LEVELS - 2; level++) {
+		void **slot = &slots[slot_index(key, level)];
+		void *next = *slot;
+		if (next == NULL) {
+		    void *node = calloc(FANOUT, sizeof(void *));
+		    if (node == NULL) {
+			fprintf(stderr, "Unable to allocate page table node\n");
+			abort();
+		    }
+		    if (__sync_bool_compare_and_swap(slot, (void *) NULL, node)) {
+			next = node;
+		    } else {
+			free(node);
+			next = *slot;
+		    }
+		}
+		slots = (void **) next;
+	    }
+
+	    void **slot = &slots[slot_index(key, LEVELS - 2)];
+	    Region *region = (Region *) *slot;
+	    if (region == NULL) {
+		Region *fresh = new_region();
+		if (__sync_bool_compare_and_swap(slot, (void *) NULL, (void *) fresh)) {
+		    region = fresh;
+		    do {
+			region->next = this->regions;
+		    } while (!__sync_bool_compare_and_swap(&this->regions, region->next, region));
+		} else {
+		    delete_region(fresh);
+		    region = (Region *) *slot;
+		}
+	    }
+	    return region;
+	}
+
+	static void free_level(void **slots, unsigned int level) {
+	    if (level == LEVELS - 2)
+		return;
+	    for (uint64_t i = 0; i < FANOUT; i++) {
+		if (slots[i] != NULL) {
+		    free_level((void **) slots[i], level + 1);
+		    free(slots[i]);
+		}
+	    }
+	}
+
+	void release() {
+	    Region *region = this->regions;
+	    while (region != NULL) {
+		Region *next = region->next;
+		delete_region(region);
+		region = next;
+	    }
+	    this->regions = NULL;
+
+	    free_level(this->root, 0);
+	    memset(this->root, 0, sizeof(this->root));
+	}
 
     public:
-	MemoryMap() : pageMap() {}
+	class iterator {
+	    const Region *region;
+	    uint64_t slot;
+
+	    void settle() {
+		while (region != NULL) {
+		    while ((slot < FANOUT) && (region->state[slot] != PAGE_READY))
+			slot++;
+		    if (slot < FANOUT)
+			return;
+		    region = region->next;
+		    slot = 0;
+		}
+	    }
+
+	public:
+	    iterator(const Region *r) : region(r), slot(0) {
+		settle();
+	    }
+
+	    T *operator*() const {
+		return region->page(slot);
+	    }
+
+	    iterator &operator++() {
+		slot++;
+		settle();
+		return *this;
+	    }
+
+	    bool operator==(const iterator &other) const {
+		return (region == other.region) && (slot == other.slot);
+	    }
+
+	    bool operator!=(const iterator &other) const {
+		return !(*this == other);
+	    }
+	};
+
+	MemoryMap() : regions(NULL) {
+	    memset(this->root, 0, sizeof(this->root));
+	}
 
         virtual ~MemoryMap() {
-            for (typename PageMap::iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-		T *node = iter->second;
-                delete node;
-            }
+	    release();
         }
 
         void clear() {
-            for (typename PageMap::iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-		T *node = iter->second;
-                delete node;
-            }
-	    pageMap.clear();
+	    release();
 	}
 
         void clearPages() {
-            for (typename PageMap::iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-                iter->second->clear();
+            for (iterator iter = this->begin(); iter != this->end(); ++iter) {
+                (*iter)->clear();
             }
         }
 
-	bool containsPage(const void * addr) {
-	    return (this->find(T::am_page_addr(addr)) != this->pageMap.end());
+	iterator begin() const {
+	    return iterator(this->regions);
+	}
+
+	iterator end() const {
+	    return iterator(NULL);
+	}
+
+	bool empty() const {
+	    return this->regions == NULL;
+	}
+
+	bool containsPage(const void * addr) const {
+	    return (this->getNode(addr) != NULL);
 	}
 
 	const T *getNode(const void *addr) const {
@@ -404,9 +589,7 @@ namespace Memory {
 	}
 
 	const T *getNode(const pageaddr_t &addr) const {
-	    typename PageMap::const_iterator iter = this->pageMap.find(addr);
-	    if (iter == this->pageMap.end()) return NULL;
-	    return iter->second;
+	    return lookup_page(page_key((const void *) (intptr_t) addr));
 	}
 
 	T *getNode(const void *addr) {
@@ -414,17 +597,24 @@ namespace Memory {
 	}
 
 	T *getNode(const pageaddr_t &addr) {
-	    typename PageMap::iterator iter = this->pageMap.find(addr);
-	    if (iter == this->pageMap.end()) return NULL;
-	    return iter->second;
+	    return lookup_page(page_key((const void *) (intptr_t) addr));
 	}
 
 	T *get_or_create_node(const void *addr) {
-	    pageaddr_t paddr = T::am_page_addr(addr);
-	    T *item = getNode(paddr);
-	    if (item == NULL) {
-                item = new T(paddr);
-                this->pageMap[paddr] = item;
+	    const uint64_t key = page_key(addr);
+	    Region *region = create_region(key);
+	    const uint64_t slot = slot_index(key, LEVELS - 1);
+	    T *item = region->page(slot);
+
+	    if (region->state[slot] != PAGE_READY) {
+		if (__sync_bool_compare_and_swap(&region->state[slot], (uint8_t) PAGE_EMPTY, (uint8_t) PAGE_BUSY)) {
+		    new (item) T(T::am_page_addr(addr));
+		    __sync_synchronize();
+		    region->state[slot] = PAGE_READY;
+		} else {
+		    while (*(volatile uint8_t *) &region->state[slot] != PAGE_READY)
+			;
+		}
 	    }
 	    return item;
 	}
@@ -453,7 +643,7 @@ namespace Memory {
 
 
     template <class T, unsigned int PAGE_BITS = DEFAULT_PAGE_BITS>
-    class MemoryNodeMap : public MemoryMap<MemoryPage<T, PAGE_BITS> > {
+    class MemoryNodeMap : public MemoryMap<MemoryPage<T, PAGE_BITS>, PAGE_BITS> {
     public:
         typedef MemoryNodeMap<T, PAGE_BITS> MapType;
 
@@ -464,14 +654,14 @@ namespace Memory {
 	MemoryNodeMap &operator=(const MapType &map) {return *this;}
 
     public:
-	MemoryNodeMap() : MemoryMap<PageType>() {}
+	MemoryNodeMap() : MemoryMap<PageType, PAGE_BITS>() {}
 
         virtual ~MemoryNodeMap() {}
 
 	template <class S>
 	const valid_t get_aligned_validity(const void * addr) const {
 	    PageType::check_addr_range(addr, sizeof(S));
-            if (this->pageMap.empty())
+            if (this->empty())
                 return NONE;
 
 	    const PageType *node = this->getNode(addr);
@@ -505,6 +695,387 @@ namespace Memory {
 	}
     };
 
+    /**
+     * Shadow page for store stamps. Aligned accesses never straddle an
+     * 8-byte word, so each word normally holds a single stamp and the valid
+     * bitmap records which of its bytes that stamp covers. Only when a
+     * narrower store leaves bytes of a word with different stamps is the
+     * word split and its bytes stamped individually, in a byte array that
+     * is allocated the first time any word of the page splits.
+     *
+     * Pages are shared by all threads. The bitmaps pack several words or
+     * bytes into one element, so they are updated with atomic and/or, and
+     * the byte array is published with a compare-and-swap. Stores by
+     * different threads to different words never interfere. Stores to
+     * different bytes of one word keep the bitmaps right, but may record
+     * the other thread's stamp for the word's bytes.
+     */
+    template<class T, unsigned int PAGE_BITS = DEFAULT_PAGE_BITS>
+    class StampPage {
+    private:
+	StampPage(const StampPage<T, PAGE_BITS> &page) {}
+
+	StampPage &operator=(const StampPage<T, PAGE_BITS> &page) {return *this;}
+
+    protected:
+	static const uint64_t PAGE_SIZE = (1ULL << PAGE_BITS);
+
+	static const uint64_t OFFSET_MASK = ((1ULL << PAGE_BITS) - 1ULL);
+
+	static const uint64_t ADDR_MASK = ~(OFFSET_MASK);
+
+	typedef uint8_t read_track_t;
+
+	// One read_track_t of valid bits per word
+	static const uint64_t WORD_SHIFT = 3;
+
+	static const uint64_t WORD_SIZE = (1ULL << WORD_SHIFT);
+
+	static const uint64_t NUM_WORDS = PAGE_SIZE / WORD_SIZE;
+
+	static const read_track_t FULL_WORD = 0xff;
+
+	pageaddr_t page_addr;
+
+	T words[NUM_WORDS];
+
+	read_track_t valid[NUM_WORDS];
+
+	read_track_t invalid[NUM_WORDS];
+
+	uint8_t split[ROUND_UP_DIVISION(NUM_WORDS, BITS_PER_BYTE)];
+
+	T *bytes;
+
+	static uint32_t am_offset(const void * addr) {
+	    return ((intptr_t) addr) & OFFSET_MASK;
+	}
+
+	static read_track_t offsetMask(const uint8_t length, const uint32_t offset) {
+	    const uint32_t bit_offset = offset % WORD_SIZE;
+	    if ((length + bit_offset) > WORD_SIZE) {
+		fprintf(stderr, "Access of %u bytes at word offset %u crosses a word\n",
+			length, bit_offset);
+		abort();
+	    }
+	    return (read_track_t) (((1ULL << length) - 1) << bit_offset);
+	}
+
+	bool is_split(const uint32_t word) const {
+	    return (this->split[word / BITS_PER_BYTE] >> (word % BITS_PER_BYTE)) & 1;
+	}
+
+	void set_split(const uint32_t word) {
+	    __sync_fetch_and_or(&this->split[word / BITS_PER_BYTE],
+				(uint8_t) (1 << (word % BITS_PER_BYTE)));
+	}
+
+	void clear_split(const uint32_t word) {
+	    __sync_fetch_and_and(&this->split[word / BITS_PER_BYTE],
+				 (uint8_t) ~(1 << (word % BITS_PER_BYTE)));
+	}
+
+	// Clears the split bits of words [first, last), a byte at a time
+	// where the range covers whole bytes of the bitmap
+	void clear_split_range(uint32_t first, uint32_t last) {
+	    while ((first < last) && ((first % BITS_PER_BYTE) != 0))
+		this->clear_split(first++);
+	    while ((first < last) && ((last % BITS_PER_BYTE) != 0))
+		this->clear_split(--last);
+	    if (first < last)
+		memset(&this->split[first / BITS_PER_BYTE], 0, (last - first) / BITS_PER_BYTE);
+	}
+
+	// Copy the word's stamp out to its valid bytes before they diverge
+	void split_word(const uint32_t word) {
+	    if (this->bytes == NULL) {
+		T *fresh = new T[PAGE_SIZE];
+		if (!__sync_bool_compare_and_swap(&this->bytes, (T *) NULL, fresh))
+		    delete [] fresh;
+	    }
+
+	    const uint32_t base = word << WORD_SHIFT;
+	    for (uint32_t i = 0; i < WORD_SIZE; i++) {
+		if (this->valid[word] & (1 << i)) {
+		    this->bytes[base + i] = this->words[word];
+		}
+	    }
+	    this->set_split(word);
+	}
+
+	void check_range(const void * addr, const uint32_t size) const {
+	    if (am_page_addr(addr) != this->page_addr) {
+		cerr<<"Access to wrong page"<<endl;
+		abort();
+	    }
+
+	    if (am_page_addr((char *) addr + size - 1) != this->page_addr) {
+		cerr<<"Access of size "<<size<<" @ "<<addr<<" crosses page boundary"<<endl;
+		abort();
+	    }
+	}
+
+	void stamp_offset(const uint32_t offset, uint8_t length, const T &item) {
+	    const uint32_t word = offset >> WORD_SHIFT;
+	    const read_track_t smask = offsetMask(length, offset);
+
+	    if ((this->valid[word] & ~smask) == 0) {
+		// Nothing outside the store survives, so one stamp covers it
+		this->words[word] = item;
+		this->clear_split(word);
+	    } else {
+		if (!this->is_split(word)) {
+		    this->split_word(word);
+		}
+		for (uint32_t i = offset; i < offset + length; i++) {
+		    this->bytes[i] = item;
+		}
+	    }
+
+	    __sync_fetch_and_or(&this->valid[word], smask);
+	    __sync_fetch_and_and(&this->invalid[word], (read_track_t) ~smask);
+	}
+
+	// Valid bytes become unknown, everything else becomes invalid
+	void set_offset_invalid(const uint32_t offset, uint8_t length) {
+	    const uint32_t word = offset >> WORD_SHIFT;
+	    const read_track_t smask = offsetMask(length, offset);
+	    const read_track_t was_valid =
+		__sync_fetch_and_and(&this->valid[word], (read_track_t) ~smask) & smask;
+	    __sync_fetch_and_and(&this->invalid[word], (read_track_t) ~was_valid);
+	    __sync_fetch_and_or(&this->invalid[word], (read_track_t) (smask & ~was_valid));
+	}
+
+	// Length of the part of [offset, end) that lies in offset's word
+	static uint32_t word_chunk(const uint32_t offset, const uint32_t end) {
+	    const uint32_t word_end = (offset & ~(WORD_SIZE - 1)) + WORD_SIZE;
+	    return ((end < word_end) ? end : word_end) - offset;
+	}
+
+	// Accumulates runs of bytes with equal stamps for visit_stamps
+	template <class Visitor>
+	struct StampRun {
+	    Visitor &visit;
+	    const T *stamp;
+	    uint64_t bytes;
+
+	    StampRun(Visitor &v) : visit(v), stamp(NULL), bytes(0) {}
+
+	    void add(const T &item, const uint64_t count) {
+		if ((this->stamp != NULL) && (*this->stamp == item)) {
+		    this->bytes += count;
+		    return;
+		}
+		this->flush();
+		this->stamp = &item;
+		this->bytes = count;
+	    }
+
+	    void flush() {
+		if (this->stamp != NULL)
+		    this->visit(*this->stamp, this->bytes);
+		this->stamp = NULL;
+	    }
+	};
+
+    public:
+	StampPage(pageaddr_t addr) : page_addr(addr), bytes(NULL) {
+	    if (am_page_addr((void *) addr) != (uint64_t) addr) {
+		cerr<<"Invalid key address"<<endl;
+		abort();
+	    }
+
+	    memset(this->valid, 0, sizeof(this->valid));
+	    memset(this->invalid, 0, sizeof(this->invalid));
+	    memset(this->split, 0, sizeof(this->split));
+	}
+
+	~StampPage() {
+	    delete [] this->bytes;
+	}
+
+	pageaddr_t getAddress() const {
+	    return this->page_addr;
+	}
+
+	bool inPage(const void *ad) const {
+	    return (am_page_addr(ad) == this->page_addr);
+	}
+
+	static uint64_t am_page_addr(const void *addr) {
+	    return ((intptr_t) addr) & ADDR_MASK;
+	}
+
+	void clear() {
+	    memset(this->valid, 0, sizeof(this->valid));
+	    memset(this->invalid, 0, sizeof(this->invalid));
+	    memset(this->split, 0, sizeof(this->split));
+	}
+
+	/// Stamp the length bytes at addr, which must lie within one word.
+	void stamp(const void *addr, uint8_t length, const T &item) {
+	    check_range(addr, length);
+	    this->stamp_offset(am_offset(addr), length, item);
+	}
+
+	/// Stamp every byte of [addr, addr + length), which must lie within
+	/// the page. Whole words are given the stamp directly; only the
+	/// partial words at either end go through stamp().
+	void stamp_range(const void *addr, uint32_t length, const T &item) {
+	    check_range(addr, length);
+	    uint32_t offset = am_offset(addr);
+	    const uint32_t end = offset + length;
+
+	    if ((offset % WORD_SIZE) != 0) {
+		const uint32_t head = word_chunk(offset, end);
+		this->stamp_offset(offset, head, item);
+		offset += head;
+	    }
+
+	    const uint32_t first = offset >> WORD_SHIFT;
+	    const uint32_t last = end >> WORD_SHIFT;
+	    if (first < last) {
+		for (uint32_t word = first; word < last; word++)
+		    this->words[word] = item;
+		memset(&this->valid[first], FULL_WORD, last - first);
+		memset(&this->invalid[first], 0, last - first);
+		this->clear_split_range(first, last);
+		offset = last << WORD_SHIFT;
+	    }
+
+	    if (offset < end)
+		this->stamp_offset(offset, end - offset, item);
+	}
+
+	/// Pass each stamp on [addr, addr + length), which must lie within
+	/// the page, to visit(stamp, bytes) along with the number of bytes it
+	/// covers. Neighbouring bytes with equal stamps are reported together,
+	/// so a range written by one store is a single call.
+	template <class Visitor>
+	void visit_stamps(const void *addr, uint32_t length, Visitor &visit) const {
+	    check_range(addr, length);
+	    StampRun<Visitor> run(visit);
+	    const uint32_t end = am_offset(addr) + length;
+
+	    for (uint32_t offset = am_offset(addr); offset < end; ) {
+		const uint32_t chunk = word_chunk(offset, end);
+		const uint32_t word = offset >> WORD_SHIFT;
+		const read_track_t live = this->valid[word] & offsetMask(chunk, offset);
+
+		if (live == 0) {
+		    // nothing stamped
+		} else if (!this->is_split(word)) {
+		    run.add(this->words[word], __builtin_popcount(live));
+		} else {
+		    for (uint32_t i = offset; i < offset + chunk; i++) {
+			if ((live & (1 << (i % WORD_SIZE))) != 0)
+			    run.add(this->bytes[i], 1);
+		    }
+		}
+		offset += chunk;
+	    }
+	    run.flush();
+	}
+
+	/// Collect the stamps of the length bytes at addr into out, skipping
+	/// bytes with no stamp and repeats of the previous stamp. Returns the
+	/// number of stamps written, which is at most length.
+	uint8_t get_stamps(const void *addr, uint8_t length, const T **out) const {
+	    check_range(addr, length);
+	    const uint32_t offset = am_offset(addr);
+	    const uint32_t word = offset >> WORD_SHIFT;
+	    const read_track_t smask = offsetMask(length, offset);
+	    const read_track_t live = this->valid[word] & smask;
+
+	    if (live == 0)
+		return 0;
+
+	    if (!this->is_split(word)) {
+		out[0] = &(this->words[word]);
+		return 1;
+	    }
+
+	    uint8_t count = 0;
+	    for (uint32_t i = offset; i < offset + length; i++) {
+		if ((live & (1 << (i % WORD_SIZE))) == 0)
+		    continue;
+		if ((count > 0) && (this->bytes[i] == *out[count - 1]))
+		    continue;
+		out[count++] = &(this->bytes[i]);
+	    }
+	    return count;
+	}
+
+	const T *getItem(const void * addr) const {
+	    const T *item = NULL;
+	    this->get_stamps(addr, 1, &item);
+	    return item;
+	}
+
+	void set_invalid(const void *addr, uint8_t length) {
+	    check_range(addr, length);
+	    this->set_offset_invalid(am_offset(addr), length);
+	}
+
+	/// set_invalid() for every byte of [addr, addr + length), which must
+	/// lie within the page, one word's mask at a time.
+	void set_invalid_range(const void *addr, uint32_t length) {
+	    check_range(addr, length);
+	    const uint32_t end = am_offset(addr) + length;
+
+	    for (uint32_t offset = am_offset(addr); offset < end; ) {
+		const uint32_t chunk = word_chunk(offset, end);
+		if (chunk == WORD_SIZE) {
+		    const uint32_t word = offset >> WORD_SHIFT;
+		    this->invalid[word] = ~this->valid[word];
+		    this->valid[word] = 0;
+		} else {
+		    this->set_offset_invalid(offset, chunk);
+		}
+		offset += chunk;
+	    }
+	}
+    };
+
+    template <class T, unsigned int PAGE_BITS = DEFAULT_PAGE_BITS>
+    class MemoryStampMap : public MemoryMap<StampPage<T, PAGE_BITS>, PAGE_BITS> {
+    public:
+        typedef MemoryStampMap<T, PAGE_BITS> MapType;
+
+        typedef StampPage<T, PAGE_BITS> PageType;
+    private:
+	MemoryStampMap(const MapType &map) {}
+
+	MemoryStampMap &operator=(const MapType &map) {return *this;}
+
+    public:
+	MemoryStampMap() : MemoryMap<PageType, PAGE_BITS>() {}
+
+        virtual ~MemoryStampMap() {}
+
+	template <class S>
+	void stamp(const void *addr, const T &item) {
+	    PageType *node = this->get_or_create_node(addr);
+	    node->stamp(addr, sizeof(S), item);
+	}
+
+	/// Length of the part of [addr, addr + length) on addr's page
+	static uint64_t page_chunk(const uint64_t addr, const uint64_t length) {
+	    const uint64_t room = (1ULL << PAGE_BITS) - (addr & ((1ULL << PAGE_BITS) - 1));
+	    return (length < room) ? length : room;
+	}
+
+	void set_invalid_range(const void *addr, uint64_t length) {
+	    uint64_t cur = (uint64_t) addr;
+	    while (length > 0) {
+		const uint64_t chunk = page_chunk(cur, length);
+		this->get_or_create_node((const void *) cur)->set_invalid_range((const void *) cur, chunk);
+		cur += chunk;
+		length -= chunk;
+	    }
+	}
+    };
+
     extern int max_seqno;
 
     /**
@@ -818,7 +1389,7 @@ namespace Memory {
     };
 
     template<unsigned int PAGE_BITS2 = DEFAULT_PAGE_BITS>
-    class MemoryValueMap : public MemoryMap<BytePage<PAGE_BITS2> > {
+    class MemoryValueMap : public MemoryMap<BytePage<PAGE_BITS2>, PAGE_BITS2> {
     public:
         typedef BytePage<PAGE_BITS2> PageType;
 
@@ -830,7 +1401,7 @@ namespace Memory {
 	MemoryValueMap &operator=(const MapType &map) {return *this;}
 
     public:
-	MemoryValueMap() : MemoryMap<PageType>() {}
+	MemoryValueMap() : MemoryMap<PageType, PAGE_BITS2>() {}
 
         virtual ~MemoryValueMap() {}
 
@@ -913,8 +1484,8 @@ namespace Memory {
 	}
 
 	void merge(const MapType *mm_version) {
-	    for (typename MemoryMap<BytePage<PAGE_BITS2> >::PageMap::const_iterator iter = mm_version->pageMap.begin(); iter != mm_version->pageMap.end(); iter++) {
-		const PageType *node = iter->second;
+	    for (typename MapType::iterator iter = mm_version->begin(); iter != mm_version->end(); ++iter) {
+		const PageType *node = *iter;
                 const pageaddr_t addr = node->getAddress();
                 PageType *this_node = this->get_or_create_node((void *) addr);
 		this_node->merge(node);
@@ -924,8 +1495,8 @@ namespace Memory {
         void commit_to_main_memory() const {
             FILE *fp = debug_log;
 
-	    for (typename MemoryMap<BytePage<PAGE_BITS2> >::PageMap::const_iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-		const PageType *node = iter->second;
+	    for (typename MapType::iterator iter = this->begin(); iter != this->end(); ++iter) {
+		const PageType *node = *iter;
 
 #ifdef MEMMAP_DEBUG
                 const uint32_t num_valid = node->print_valid_ranges(fp);
@@ -941,8 +1512,8 @@ namespace Memory {
 
         void print_valid_ranges() const {
             FILE *fp = debug_log;
-            for (typename MemoryMap<BytePage<PAGE_BITS2> >::PageMap::const_iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-		const PageType *node = iter->second;
+            for (typename MapType::iterator iter = this->begin(); iter != this->end(); ++iter) {
+		const PageType *node = *iter;
 
                 const uint32_t num_valid = node->print_valid_ranges(fp);
                 if ((fp != NULL) && (num_valid > 0))
@@ -952,8 +1523,8 @@ namespace Memory {
 
 	bool are_values_correct() const {
             FILE *fp = debug_log;
-	    for (typename MemoryMap<BytePage<PAGE_BITS2> >::MapType::PageMap::const_iterator iter = this->pageMap.begin(); iter != this->pageMap.end(); iter++) {
-		const PageType *node = iter->second;
+	    for (typename MapType::iterator iter = this->begin(); iter != this->end(); ++iter) {
+		const PageType *node = *iter;
 
 #ifdef MEMMAP_DEBUG
                 const uint32_t num_valid = node->print_valid_ranges(fp);
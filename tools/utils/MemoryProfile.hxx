@@ -20,17 +20,48 @@ namespace Profiling {
 	
 	uint64_t loop_count;
 
+	// Iteration epoch loop_count was last incremented in; 0 is never
+	uint64_t loop_epoch;
+
     public:
-	MemoryProfile() : total_count(0), loop_count(0) {}
+	MemoryProfile() : total_count(0), loop_count(0), loop_epoch(0) {}
 
 	void increment() {
 	    total_count++;
 	}
 
+	void increment(const uint64_t count) {
+	    total_count += count;
+	}
+
 	void incrementLoop() {
 	    loop_count++;
 	}
 
+	/// Count the iteration identified by epoch, unless it has already
+	/// been counted. Epochs must be unique, so that starting a new
+	/// iteration only needs a new epoch rather than a reset of every
+	/// profile.
+	void incrementLoop(const uint64_t epoch) {
+	    if (loop_epoch != epoch) {
+		loop_epoch = epoch;
+		loop_count++;
+	    }
+	}
+
+	uint64_t getTotalCount() const {
+	    return total_count;
+	}
+
+	uint64_t getLoopCount() const {
+	    return loop_count;
+	}
+
+	void merge(const MemoryProfile &other) {
+	    total_count += other.total_count;
+	    loop_count += other.loop_count;
+	}
+
 	friend ostream &operator<<(ostream &stream, const MemoryProfile &vp);
     };
 
@@ -51,6 +82,12 @@ namespace Profiling {
 	    return profile;
 	}	
 
+	MemoryProfile & increment(const Dependence &dep, const uint64_t count) {
+	    MemoryProfile &profile = this->getProfile(dep);
+	    profile.increment(count);
+	    return profile;
+	}
+
 	template<int S>
 	friend ostream &operator<<(ostream &stream, const MemoryProfiler<S> &vp);
     };
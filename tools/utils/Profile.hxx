@@ -8,6 +8,7 @@
 #include <map>
 #include <vector>
 #include <iterator>
+#include <algorithm>
 
 #include <ext/hash_set>
 
@@ -17,15 +18,6 @@ using namespace __gnu_cxx;
 
 namespace Profiling {
 
-    typedef struct ls_key_s {
-        uint32_t store;
-        uint32_t loop;
-    }  __attribute__((__packed__)) ls_key_t;
-
-    bool operator<(const ls_key_t &ls1, const ls_key_t&ls2) {
-        return *((uint32_t *) &ls1) < *((uint32_t *) &ls2);
-    }
-
     static const uint64_t PROFILE_INSTR_MAX = ((1ULL << 16) - 1);
     static const uint64_t PROFILE_LOOP_MAX = ((1ULL << 16) - 1);
 
@@ -69,28 +61,81 @@ namespace Profiling {
 
     typedef hash_set<Dependence, DependenceHash, DependenceEquals> DependenceSet;
 
+    /**
+     * Profiles keyed by dependence. The (load, dist, store, loop) tuple is
+     * packed into 64 bits and kept in an open-addressed table with linear
+     * probing, so finding a profile is normally a single probe. The packed
+     * key orders dependences the way they are printed, so output only has
+     * to sort the keys.
+     */
     template <class T, int maxTrackedDistance = DEFAULT_TRACKED_DISTANCE>
     class KeyDistanceProfiler {
     public:
 
 	static const uint64_t MAX_TRACKED_DISTANCE = maxTrackedDistance;
-		
-	typedef map<ls_key_t, T> KeyProfilerMap;
-	
-	typedef vector<KeyProfilerMap> DistanceMaps;
-	
-	typedef vector<DistanceMaps> InstructionMaps;
-	
+
     private:
-	InstructionMaps instructionInfo;
+	static const uint64_t FIELD_BITS = 16;
 
-    public:
-	KeyDistanceProfiler(const uint32_t num_instrs) : instructionInfo(num_instrs){
-            if (sizeof(ls_key_t) != sizeof(uint64_t)) {
-                cerr<<"sizeof(ls_key_t) != sizeof(uint32_t) ("<<sizeof(ls_key_t)<<" != "<<sizeof(uint64_t)<<")"<<endl;
-                abort();
-            }
+	static const uint64_t FIELD_MASK = ((1ULL << FIELD_BITS) - 1);
+
+	// No load can have id FIELD_MASK, so this never collides with a key
+	static const uint64_t EMPTY_KEY = ~0ULL;
+
+	static const uint64_t INITIAL_SIZE = 1024;
+
+	struct Entry {
+	    uint64_t key;
+	    T value;
+
+	    Entry() : key(EMPTY_KEY), value() {}
+	};
+
+	typedef vector<Entry> EntryTable;
+
+	EntryTable table;
+
+	uint64_t num_entries;
+
+	static uint64_t packKey(const Dependence &dep, const uint32_t dist) {
+	    if ((dep.store > FIELD_MASK) || (dep.loop > FIELD_MASK)) {
+		cerr<<"Dependence "<<dep.store<<" -> "<<dep.load<<" in loop "<<dep.loop<<" out of profile range"<<endl;
+		abort();
+	    }
+	    return (((uint64_t) dep.load) << (3 * FIELD_BITS)) | (((uint64_t) dist) << (2 * FIELD_BITS))
+		| (((uint64_t) dep.store) << FIELD_BITS) | ((uint64_t) dep.loop);
+	}
+
+	static Dependence unpackKey(const uint64_t key) {
+	    return Dependence((key >> FIELD_BITS) & FIELD_MASK, key & FIELD_MASK,
+			      (key >> (2 * FIELD_BITS)) & FIELD_MASK, (key >> (3 * FIELD_BITS)) & FIELD_MASK);
+	}
 
+	static uint64_t hash(const uint64_t key) {
+	    const uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+	    return h ^ (h >> 32);
+	}
+
+	Entry &findEntry(EntryTable &entries, const uint64_t key) {
+	    const uint64_t mask = entries.size() - 1;
+	    uint64_t slot = hash(key) & mask;
+	    while ((entries[slot].key != key) && (entries[slot].key != EMPTY_KEY)) {
+		slot = (slot + 1) & mask;
+	    }
+	    return entries[slot];
+	}
+
+	void grow() {
+	    EntryTable old(this->table.size() * 2);
+	    old.swap(this->table);
+	    for (typename EntryTable::const_iterator iter = old.begin(); iter != old.end(); iter++) {
+		if (iter->key != EMPTY_KEY)
+		    findEntry(this->table, iter->key) = *iter;
+	    }
+	}
+
+    public:
+	KeyDistanceProfiler(const uint32_t num_instrs) : table(INITIAL_SIZE), num_entries(0) {
 	    if (num_instrs > PROFILE_INSTR_MAX) {
 		cerr<<"Number of instructions must be less than "<<PROFILE_INSTR_MAX<<" "<<num_instrs<<" given"<<endl;
 		abort();
@@ -102,50 +147,63 @@ namespace Profiling {
 	    return tracked_distance;
 	}
 	
+	/// The returned reference is valid until the next call.
 	T & getProfile(const Dependence &dep) {
-	    DistanceMaps &distanceMap = instructionInfo.at(dep.load);
-	    
-	    if (distanceMap.empty()) {
-		for (uint32_t i = 0; i < maxTrackedDistance; i++) {
-		    distanceMap.push_back(KeyProfilerMap());
+	    const uint64_t key = packKey(dep, trackedDistance(dep.dist));
+
+	    Entry *entry = &findEntry(this->table, key);
+	    if (entry->key == EMPTY_KEY) {
+		// Keep the table at most half full so probe runs stay short
+		if (2 * (this->num_entries + 1) > this->table.size()) {
+		    grow();
+		    entry = &findEntry(this->table, key);
 		}
+		entry->key = key;
+		this->num_entries++;
 	    }
-	    
-	    const uint32_t tracked_distance = trackedDistance(dep.dist);
-
-	    KeyProfilerMap &valueMap = distanceMap.at(tracked_distance);
-	    
-            const ls_key_t key = {dep.store, dep.loop};
-	    if (valueMap.find(key) == valueMap.end()) {
-		T value_count;
-		valueMap[key] = value_count;
+	    return entry->value;
+	}
+
+	/// Fold another profiler's counts into this one, e.g. when combining
+	/// per-thread profiles.
+	void merge(const KeyDistanceProfiler<T, maxTrackedDistance> &other) {
+	    for (typename EntryTable::const_iterator iter = other.table.begin(); iter != other.table.end(); iter++) {
+		if (iter->key != EMPTY_KEY)
+		    this->getProfile(unpackKey(iter->key)).merge(iter->value);
 	    }
-	    T &profiler = valueMap[key];
-	    return profiler;
 	}
 
-	template<class S, int D>
-	friend ostream &operator<<(ostream &stream, const KeyDistanceProfiler<S, D> &vp);
+	typedef pair<Dependence, const T *> ProfileEntry;
+
+	/// Every profiled dependence with its profile, in output order.
+	void getEntries(vector<ProfileEntry> &entries) const {
+	    typedef pair<uint64_t, const Entry *> KeyedEntry;
+
+	    vector<KeyedEntry> keyed;
+	    keyed.reserve(this->num_entries);
+	    for (typename EntryTable::const_iterator iter = this->table.begin(); iter != this->table.end(); iter++) {
+		if (iter->key != EMPTY_KEY)
+		    keyed.push_back(KeyedEntry(iter->key, &*iter));
+	    }
+	    sort(keyed.begin(), keyed.end());
+
+	    entries.reserve(entries.size() + keyed.size());
+	    for (uint64_t i = 0; i < keyed.size(); i++) {
+		entries.push_back(ProfileEntry(unpackKey(keyed[i].first), &keyed[i].second->value));
+	    }
+	}
     };
     
     template<class T, int D>
     ostream &operator<<(ostream &stream, const KeyDistanceProfiler<T, D> &vp){
-	typename KeyDistanceProfiler<T, D>::InstructionMaps::const_iterator instrIter = vp.instructionInfo.begin();
-	for (; instrIter != vp.instructionInfo.end(); instrIter++) {
-	    const uint32_t load = distance(vp.instructionInfo.begin(), instrIter);
-	    typename KeyDistanceProfiler<T, D>::DistanceMaps::const_iterator distIter = instrIter->begin();
-	    for (; distIter != instrIter->end(); distIter++) {
-		const uint32_t dist = distance(instrIter->begin(), distIter);
-		typename KeyDistanceProfiler<T, D>::KeyProfilerMap::const_iterator keyIter = distIter->begin();
-		for(; keyIter != distIter->end(); keyIter++) {
-		    const ls_key_t key = keyIter->first;
-		    const uint32_t loop = key.loop;
-		    const uint32_t store = key.store;
-		    const T &profile = (keyIter->second);
-		    
-		    stream<<"("<<load<<" "<<dist<<" "<<loop<<" "<<store<<" ("<<profile<<") )"<<endl;
-		}
-	    }
+	vector<typename KeyDistanceProfiler<T, D>::ProfileEntry> entries;
+	vp.getEntries(entries);
+
+	for (uint64_t i = 0; i < entries.size(); i++) {
+	    const Dependence &dep = entries[i].first;
+	    const T &profile = *entries[i].second;
+
+	    stream<<"("<<dep.load<<" "<<dep.dist<<" "<<dep.loop<<" "<<dep.store<<" ("<<profile<<") )"<<endl;
 	}
 	return stream;
     }
@@ -0,0 +1,88 @@
+#ifndef TRACE_BUFFER_H
+#define TRACE_BUFFER_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace Trace {
+
+    /**
+     * Single-producer, single-consumer ring buffer of trace records. The
+     * producer appends with push(); the consumer hands every record
+     * published so far to a functor with drain(). The two may run on
+     * different threads without a lock: each side only writes its own
+     * counter and publishes it after a full barrier.
+     */
+    template <class T>
+    class TraceBuffer {
+    private:
+	TraceBuffer(const TraceBuffer<T> &buffer) {}
+
+	TraceBuffer &operator=(const TraceBuffer<T> &buffer) {return *this;}
+
+	T *records;
+
+	const uint64_t capacity;
+
+	const uint64_t mask;
+
+	// Total records consumed and produced; both only ever grow
+	volatile uint64_t head;
+
+	volatile uint64_t tail;
+
+    public:
+	TraceBuffer(uint64_t size)
+	    : records(NULL), capacity(size), mask(size - 1), head(0), tail(0) {
+	    if ((size == 0) || ((size & (size - 1)) != 0)) {
+		fprintf(stderr, "Trace buffer size %" PRIu64 " is not a power of two\n", size);
+		abort();
+	    }
+	    this->records = new T[size];
+	}
+
+	~TraceBuffer() {
+	    delete [] this->records;
+	}
+
+	bool empty() const {
+	    return this->head == this->tail;
+	}
+
+	bool full() const {
+	    return (this->tail - this->head) == this->capacity;
+	}
+
+	/// Append a record; returns false if the buffer is full.
+	bool push(const T &record) {
+	    const uint64_t t = this->tail;
+	    if ((t - this->head) == this->capacity)
+		return false;
+
+	    this->records[t & this->mask] = record;
+	    __sync_synchronize();
+	    this->tail = t + 1;
+	    return true;
+	}
+
+	/// Pass every published record to consumer in order, then release
+	/// their slots. Returns the number of records consumed.
+	template <class Consumer>
+	uint64_t drain(Consumer &consumer) {
+	    const uint64_t h = this->head;
+	    const uint64_t t = this->tail;
+	    __sync_synchronize();
+
+	    for (uint64_t i = h; i != t; i++) {
+		consumer(this->records[i & this->mask]);
+	    }
+
+	    __sync_synchronize();
+	    this->head = t;
+	    return t - h;
+	}
+    };
+}
+
+#endif